@@ -139,6 +139,7 @@ class Dashboard(QMainWindow):
         pg.setConfigOption('foreground', 'y')
         pg.setConfigOptions(antialias=True)
         styles = {'color': 'cyan', 'font-size': '13px', 'bottom_margin': '50px'}
+        self.label_styles = styles
         hline_style = {'border-style': 'solid', 'border-color': 'green', 'bottom_margin': '50px'}
 
         self.output_plot = pg.PlotWidget()
@@ -538,16 +539,20 @@ class Dashboard(QMainWindow):
         self.lbl_tm_val.setText(F"{self.parameters['Tm']}")
 
     def write_parameters(self):
-        for spinner in self.findChildren(QDoubleSpinBox):
-            pass
+        # several parameters go on each line. The target accepts up to 63 characters
+        msg = ''
         for key in self.parameters:
             spinner = self.findChild(QDoubleSpinBox, key)
             value = self.parameters[key]
             if spinner:
                 value = spinner.value()
-            msg = F"{key} = {value}\n"
-            # print(msg)
-            self.write(msg)
+            pair = F"{key} {value:g}"
+            if msg and len(msg) + len(pair) + 1 > 63:
+                self.query(msg + '\n')
+                msg = ''
+            msg = F"{msg} {pair}" if msg else pair
+        if msg:
+            self.query(msg + '\n')
 
     def target_reset(self):
         self.output_plot.clear()
@@ -630,6 +635,8 @@ class Dashboard(QMainWindow):
                     f = d[-1]
                 d[i].append(f)
         self.output_plot.clear()
+        self.output_plot.setLabel('bottom', 'time (ms)', **self.label_styles)
+        self.motion_plot.setLabel('bottom', 'time (ms)', **self.label_styles)
         self.plot(d[0], d[1], self.output_plot, headings[1], palette[3], Qt.SolidLine)
         # self.output_plot.enableAutoRange()
         # self.output_plot.disableAutoRange()
@@ -652,7 +659,7 @@ class Dashboard(QMainWindow):
         self.data = self.query(F'MOVE {self.move_mode}\n')
         self.log_data()
         d = [[] for i in range(self.nChannels)]
-        # "$time set_pos robot_pos set_speed robot_speed ctrl_volts ff_volts, motor_volts"
+        # "$tick set_pos robot_pos set_speed robot_speed ctrl_volts ff_volts, motor_volts"
         pdata = []
         vdata = []
         comments = []
@@ -678,6 +685,9 @@ class Dashboard(QMainWindow):
             d[5][i] = max(d[5][i], -6.0)
 
         self.output_plot.clear()
+        # the controller reports are timestamped in ticks
+        self.output_plot.setLabel('bottom', 'ticks', **self.label_styles)
+        self.motion_plot.setLabel('bottom', 'ticks', **self.label_styles)
         if self.move_mode == NO_FF:
             style = Qt.DotLine
         else:
@@ -0,0 +1,228 @@
+#!/usr/bin/env python3
+# -*- coding:utf-8 -*-
+###
+# Project: <<project>>
+# File:    motorlab-link.py
+# -----
+# Licence:
+# MIT License
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy of
+# this software and associated documentation files (the "Software"), to deal in
+# the Software without restriction, including without limitation the rights to
+# use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+# of the Software, and to permit persons to whom the Software is furnished to do
+# so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in all
+# copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+# SOFTWARE.
+###
+
+
+# Sends binary commands to the motorlab target and reads the responses.
+# The protocol is described in ukmarsbot-motorlab/src/protocol.h
+#
+# The Link class can be copied into other programs. Run on its own, the
+# script offers a few simple commands:
+#
+#   python3 motorlab-link.py /dev/ttyUSB0 ping
+#   python3 motorlab-link.py /dev/ttyUSB0 params
+#   python3 motorlab-link.py /dev/ttyUSB0 set 8 1.5 9 0.02
+#   python3 motorlab-link.py /dev/ttyUSB0 trial 0 "0 1440 3600 0 14400"
+#   python3 motorlab-link.py /dev/ttyUSB0 abort
+#   python3 motorlab-link.py /dev/ttyUSB0 capture
+#
+# Parameter ids are the row numbers in the table in src/parameters.h.
+# Only pyserial is needed.
+
+import argparse
+import struct
+import sys
+
+OP_PING = 0x01
+OP_PARAM_READ = 0x10
+OP_PARAM_WRITE = 0x11
+OP_TRIAL_START = 0x20
+OP_TRIAL_ABORT = 0x21
+OP_CAPTURE_INFO = 0x30
+OP_CAPTURE_READ = 0x31
+
+ACK = 0x06
+NAK = 0x15
+NAK_REASONS = {1: 'bad frame', 2: 'unknown opcode', 3: 'bad length', 4: 'bad argument', 5: 'busy'}
+
+TRIALS = ['MOVE', 'STEP', 'QMOVE', 'VOLTS', 'STREAM']
+
+
+def crc8(data):
+    # the same calculation as crc8() in src/utils.h
+    crc = 0
+    for byte in data:
+        crc ^= byte << 8
+        for _ in range(8):
+            if crc & 0x8000:
+                crc ^= 0x1070 << 3
+            crc = (crc << 1) & 0xFFFF
+    return crc >> 8
+
+
+def cobs_encode(data):
+    out = bytearray([0])
+    code_index = 0
+    code = 1
+    for byte in data:
+        if byte == 0:
+            out[code_index] = code
+            code_index = len(out)
+            out.append(0)
+            code = 1
+        else:
+            out.append(byte)
+            code += 1
+    out[code_index] = code
+    return bytes(out)
+
+
+def cobs_decode(frame):
+    out = bytearray()
+    i = 0
+    while i < len(frame):
+        code = frame[i]
+        if code == 0 or i + code > len(frame):
+            return None
+        out += frame[i + 1:i + code]
+        i += code
+        if code < 0xFF and i < len(frame):
+            out.append(0)
+    return bytes(out)
+
+
+class NakError(Exception):
+    pass
+
+
+class Link:
+    def __init__(self, port):
+        # port is anything with read() and write(), like a pyserial Serial
+        self.port = port
+        self.sequence = 0
+        self.text = bytearray()  # anything that was not a response
+
+    def request(self, opcode, payload=b''):
+        self.sequence = (self.sequence + 1) & 0xFF
+        raw = bytes([self.sequence, opcode]) + payload
+        self.port.write(b'\x00' + cobs_encode(raw + bytes([crc8(raw)])) + b'\x00')
+        return self.response(opcode)
+
+    def response(self, opcode):
+        buffer = bytearray()
+        while True:
+            byte = self.port.read(1)
+            if not byte:
+                raise TimeoutError('no response')
+            if byte[0] != 0:
+                buffer += byte
+                continue
+            raw = cobs_decode(bytes(buffer))
+            buffer = bytearray()
+            if not raw or len(raw) < 4 or crc8(raw[:-1]) != raw[-1]:
+                # text from the target
+                continue
+            if raw[0] != self.sequence or raw[1] not in (ACK, NAK) or raw[2] != opcode:
+                # an old response or a telemetry record
+                continue
+            if raw[1] == NAK:
+                raise NakError(NAK_REASONS.get(raw[3], raw[3]))
+            return raw[3:-1]
+
+    def ping(self):
+        version, count = struct.unpack('<BB', self.request(OP_PING))
+        return version, count
+
+    def read_params(self, first=0, count=255):
+        reply = self.request(OP_PARAM_READ, bytes([first, count]))
+        first, count = reply[0], reply[1]
+        return list(struct.unpack('<%df' % count, reply[2:2 + 4 * count]))
+
+    def read_all_params(self):
+        values = []
+        _, count = self.ping()
+        while len(values) < count:
+            values += self.read_params(len(values), count - len(values))
+        return values
+
+    def write_params(self, values):
+        # values is a dict of id: value. Returns the values as stored.
+        payload = b''.join(struct.pack('<Bf', i, v) for i, v in values.items())
+        reply = self.request(OP_PARAM_WRITE, payload)
+        return {reply[n]: struct.unpack('<f', reply[n + 1:n + 5])[0] for n in range(0, len(reply), 5)}
+
+    def start_trial(self, trial, arguments=''):
+        self.request(OP_TRIAL_START, bytes([trial]) + arguments.upper().encode('ascii'))
+
+    def abort(self):
+        self.request(OP_TRIAL_ABORT)
+
+    def capture_info(self):
+        names = ('state', 'mask', 'divisor', 'samples', 'capacity', 'trigger_offset', 'trigger_lag')
+        return dict(zip(names, struct.unpack('<BBBHHHB', self.request(OP_CAPTURE_INFO))))
+
+    def read_capture(self):
+        info = self.capture_info()
+        channels = bin(info['mask']).count('1')
+        total = info['samples'] * channels
+        values = []
+        while len(values) < total:
+            reply = self.request(OP_CAPTURE_READ, struct.pack('<HB', len(values), 255))
+            count = (len(reply) - 2) // 2
+            values += struct.unpack('<%dh' % count, reply[2:])
+        rows = [values[i:i + channels] for i in range(0, total, channels)]
+        return info, rows
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Send binary commands to the motorlab target')
+    parser.add_argument('port', help='serial port')
+    parser.add_argument('command', choices=['ping', 'params', 'set', 'trial', 'abort', 'capture'])
+    parser.add_argument('args', nargs='*')
+    parser.add_argument('--baud', type=int, default=115200)
+    args = parser.parse_args()
+
+    from serial import Serial
+    with Serial(args.port, args.baud, timeout=1.0) as port:
+        link = Link(port)
+        if args.command == 'ping':
+            print('protocol %d, %d parameters' % link.ping())
+        elif args.command == 'params':
+            for i, value in enumerate(link.read_all_params()):
+                print(i, value)
+        elif args.command == 'set':
+            pairs = {int(args.args[n]): float(args.args[n + 1]) for n in range(0, len(args.args) - 1, 2)}
+            for i, value in link.write_params(pairs).items():
+                print(i, value)
+        elif args.command == 'trial':
+            link.start_trial(int(args.args[0]), ' '.join(args.args[1:]))
+            try:
+                while True:
+                    sys.stdout.write(port.read(256).decode('ascii', errors='replace'))
+            except KeyboardInterrupt:
+                pass
+        elif args.command == 'abort':
+            link.abort()
+        elif args.command == 'capture':
+            info, rows = link.read_capture()
+            print(info)
+            for n, row in enumerate(rows):
+                print((n - info['trigger_offset']) * info['divisor'] + info['trigger_lag'], *row)
+
+
+if __name__ == '__main__':
+    main()
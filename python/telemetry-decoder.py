@@ -0,0 +1,185 @@
+#!/usr/bin/env python3
+# -*- coding:utf-8 -*-
+###
+# Project: <<project>>
+# File:    telemetry-decoder.py
+# -----
+# Licence:
+# MIT License
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy of
+# this software and associated documentation files (the "Software"), to deal in
+# the Software without restriction, including without limitation the rights to
+# use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+# of the Software, and to permit persons to whom the Software is furnished to do
+# so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in all
+# copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+# SOFTWARE.
+###
+
+# Decodes the binary telemetry sent by the motorlab target after TELEM 1.
+# The record layout is described in ukmarsbot-motorlab/src/telemetry.h
+#
+# Reads from a serial port or from a file of captured bytes and writes the
+# same columns as the text controller report, in degrees and seconds, to
+# stdout. Any text from the target, like the trial comment lines, is passed
+# through as it is. Lost records, bad frames and ticks that were not sent
+# are counted and reported on stderr at the end. If the target was set to
+# send a record every N ticks, with TELEM 1 N, give the same --interval so
+# that only the records it failed to send count as ticks not sent.
+#
+# Only pyserial is needed, and only for reading a serial port.
+#
+#   python3 telemetry-decoder.py /dev/ttyUSB0
+#   python3 telemetry-decoder.py capture.bin > trial.txt
+
+import argparse
+import struct
+import sys
+
+RECORD = struct.Struct('<BHihhhhhh')
+RAW_SIZE = RECORD.size + 1  # with the crc
+FRAME_SIZE = RAW_SIZE + 1  # COBS adds one byte. The zero terminator is not included
+SPEED_SCALE = 4  # steps per count per second, as in telemetry.h
+
+# these must match config.h and the robot config on the target
+DEFAULT_DEG_PER_COUNT = 360 / (12 * 9.966)
+DEFAULT_LOOP_HZ = 500
+
+
+def crc8(data):
+    # the same calculation as crc8() in src/utils.h
+    crc = 0
+    for byte in data:
+        crc ^= byte << 8
+        for _ in range(8):
+            if crc & 0x8000:
+                crc ^= 0x1070 << 3
+            crc = (crc << 1) & 0xFFFF
+    return crc >> 8
+
+
+def cobs_decode(frame):
+    out = bytearray()
+    i = 0
+    while i < len(frame):
+        code = frame[i]
+        if code == 0 or i + code > len(frame):
+            return None
+        out += frame[i + 1:i + code]
+        i += code
+        if code < 0xFF and i < len(frame):
+            out.append(0)
+    return bytes(out)
+
+
+class Decoder:
+    def __init__(self, deg_per_count, loop_hz, out, interval=1):
+        self.deg_per_count = deg_per_count
+        self.interval = interval
+        self.loop_hz = loop_hz
+        self.out = out
+        self.buffer = bytearray()
+        self.last_sequence = None
+        self.last_tick = None
+        self.tick_base = 0
+        self.first_tick = None
+        self.records = 0
+        self.lost = 0
+        self.skipped_ticks = 0
+        self.bad_frames = 0
+
+    def feed(self, data):
+        self.buffer += data
+        while True:
+            end = self.buffer.find(0)
+            if end < 0:
+                return
+            chunk = bytes(self.buffer[:end])
+            del self.buffer[:end + 1]
+            self.chunk(chunk)
+
+    def chunk(self, chunk):
+        # text may come before a frame since text never contains a zero
+        text = chunk[:-FRAME_SIZE] if len(chunk) > FRAME_SIZE else b''
+        frame = chunk[-FRAME_SIZE:]
+        raw = cobs_decode(frame) if len(frame) == FRAME_SIZE else None
+        if raw is None or len(raw) != RAW_SIZE or crc8(raw[:-1]) != raw[-1]:
+            if b'$' not in chunk and b'#' not in chunk and b'>' not in chunk:
+                self.bad_frames += 1
+            self.text(chunk)
+            return
+        self.text(text)
+        self.record(raw[:-1])
+
+    def text(self, text):
+        if text:
+            self.out.write(text.decode('ascii', errors='replace'))
+
+    def record(self, raw):
+        seq, tick, set_pos, error, set_speed, robot_speed, ctrl_mv, ff_mv, motor_mv = RECORD.unpack(raw)
+        self.records += 1
+        if self.last_sequence is not None:
+            self.lost += (seq - self.last_sequence - 1) & 0xFF
+        self.last_sequence = seq
+        # unwrap the 16 bit tick count
+        if self.last_tick is not None:
+            if tick < self.last_tick:
+                self.tick_base += 0x10000
+            gap = (tick - self.last_tick) & 0xFFFF
+            if gap > self.interval:
+                self.skipped_ticks += gap - self.interval
+        else:
+            self.first_tick = tick
+            self.out.write('$tick time set_pos robot_pos set_speed robot_speed ctrl_volts ff_volts motor_volts\n')
+        self.last_tick = tick
+        ticks = self.tick_base + tick - self.first_tick
+        k = self.deg_per_count
+        set_pos = set_pos / 256
+        robot_pos = set_pos - error / 64
+        self.out.write('%d %.4f %.2f %.2f %.1f %.1f %.3f %.3f %.3f\n' % (
+            ticks, ticks / self.loop_hz,
+            set_pos * k, robot_pos * k,
+            set_speed / SPEED_SCALE * k, robot_speed / SPEED_SCALE * k,
+            ctrl_mv / 1000, ff_mv / 1000, motor_mv / 1000))
+
+    def summary(self):
+        sys.stderr.write('records %d lost %d bad frames %d ticks not sent %d\n' % (
+            self.records, self.lost, self.bad_frames, self.skipped_ticks))
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Decode motorlab binary telemetry')
+    parser.add_argument('source', help='serial port or file of captured bytes')
+    parser.add_argument('--baud', type=int, default=115200)
+    parser.add_argument('--deg-per-count', type=float, default=DEFAULT_DEG_PER_COUNT)
+    parser.add_argument('--loop-hz', type=float, default=DEFAULT_LOOP_HZ)
+    parser.add_argument('--interval', type=int, default=1, help='ticks between records')
+    args = parser.parse_args()
+
+    decoder = Decoder(args.deg_per_count, args.loop_hz, sys.stdout, args.interval)
+    try:
+        if args.source.startswith('/dev/') or args.source.upper().startswith('COM'):
+            from serial import Serial
+            with Serial(args.source, args.baud, timeout=0.1) as port:
+                while True:
+                    decoder.feed(port.read(256))
+        else:
+            with open(args.source, 'rb') as f:
+                decoder.feed(f.read())
+    except KeyboardInterrupt:
+        pass
+    decoder.summary()
+
+
+if __name__ == '__main__':
+    main()
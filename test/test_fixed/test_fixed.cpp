@@ -0,0 +1,164 @@
+/***
+ * Host side check that the fixed point control path gives the same
+ * motor voltage as the float version. Run it with
+ *
+ *     pio test -e native
+ *
+ * The controller and feedforward arithmetic that Motors runs is in
+ * src/control.h. It is built here twice, once with float and once with
+ * the real_t and coeff_t formats of src/fixed.h, and both are given the
+ * same inputs. The setpoints of a default MOVE are worked out here
+ * with a simple trapezoid, standing in for Profile, and the robot
+ * follows a few ticks behind. The stated tolerance is in src/fixed.h.
+ *
+ * The gains at the top of their parameter limits would overflow a
+ * real_t. Those cases check that the output saturates with the same
+ * sign as float rather than wrapping round.
+ */
+#include <math.h>
+#include <unity.h>
+
+// fixed.h only needs config.h for CONTROL_FIXED_POINT, which is not
+// wanted here because both number formats are used side by side
+#define CONFIG_H
+#include "../../ukmarsbot-motorlab/src/control.h"
+
+typedef Fixed<16> fixed_real;
+typedef Fixed<24> fixed_coeff;
+
+// must match the comment in src/fixed.h
+const float MAX_VOLTS_ERROR = 0.01f;
+
+// the defaults from config-motorlab.h and config.h at 500Hz
+const float LOOP_FREQUENCY = 500.0f;
+const float DEG_PER_COUNT = 360 / (12.0f * 9.966f);
+const float KP = 0.19081f;
+const float KD = 0.0072650f;
+const float SPEED_FF = 0.00048433f;
+const float ACC_FF = 0.00015741f;
+const float BIAS_FF = 0.145f;
+const float BIAS_THRESHOLD = 0.1f / DEG_PER_COUNT; // counts per second, as in Motors
+
+// the top of the parameter limits in src/parameters.h, at the fastest loop rate
+const float MAX_KP = 10;
+const float MAX_KD = 2.5f;
+const float MAX_ACC_FF = 2.5f;
+const float MAX_FREQUENCY = 2000.0f;
+
+typedef ControlGains<float, float> FloatGains;
+typedef ControlGains<fixed_real, fixed_coeff> FixedGains;
+
+struct ControlInput {
+  float set_position; // counts
+  float speed;        // counts per second
+  float acceleration; // change in speed over the last tick
+  long robot_position; // whole counts from the encoder
+};
+
+// MOVE 0 1440 3600 0 14400, with the robot a few ticks behind
+static ControlInput move_input(int tick) {
+  static float position = 0;
+  static float speed = 0;
+  static float history[4] = {0};
+  const float distance = 1440 / DEG_PER_COUNT;
+  const float top_speed = 3600 / DEG_PER_COUNT;
+  const float accel = 14400 / DEG_PER_COUNT / LOOP_FREQUENCY;
+  ControlInput in;
+  float braking = speed * speed / (2 * accel * LOOP_FREQUENCY);
+  float old_speed = speed;
+  if (distance - position <= braking) {
+    speed = fmaxf(speed - accel, 0);
+  } else {
+    speed = fminf(speed + accel, top_speed);
+  }
+  position += speed / LOOP_FREQUENCY;
+  in.set_position = position;
+  in.speed = speed;
+  in.acceleration = speed - old_speed;
+  in.robot_position = (long)floorf(history[tick % 4]);
+  history[tick % 4] = position;
+  return in;
+}
+
+static float float_volts(const FloatGains &gains, const ControlInput &in, float &previous_error) {
+  float error = in.set_position - in.robot_position;
+  float diff = error - previous_error;
+  previous_error = error;
+  return gains.position_output(error, diff) + gains.feed_forward(in.speed, in.acceleration, BIAS_THRESHOLD);
+}
+
+static float fixed_volts(const FixedGains &gains, const ControlInput &in, fixed_real &previous_error) {
+  fixed_real error = fixed_real(in.set_position) - fixed_real(in.robot_position);
+  fixed_real diff = error - previous_error;
+  previous_error = error;
+  fixed_real volts = gains.position_output(error, diff);
+  volts += gains.feed_forward(in.speed, in.acceleration, BIAS_THRESHOLD);
+  return float(volts);
+}
+
+void test_move_volts_match(void) {
+  FloatGains float_gains;
+  FixedGains fixed_gains;
+  float_gains.load(KP, KD, SPEED_FF, ACC_FF, BIAS_FF, DEG_PER_COUNT, LOOP_FREQUENCY);
+  fixed_gains.load(KP, KD, SPEED_FF, ACC_FF, BIAS_FF, DEG_PER_COUNT, LOOP_FREQUENCY);
+  float float_error = 0;
+  fixed_real fixed_error = 0;
+  float worst = 0;
+  for (int tick = 0; tick < 1000; tick++) {
+    ControlInput in = move_input(tick);
+    float difference = fabsf(float_volts(float_gains, in, float_error) - fixed_volts(fixed_gains, in, fixed_error));
+    worst = fmaxf(worst, difference);
+  }
+  TEST_ASSERT_FLOAT_WITHIN(MAX_VOLTS_ERROR, 0.0f, worst);
+}
+
+void test_multiply_matches_float(void) {
+  const float values[] = {-300.25f, -1.5f, -0.001f, 0.0f, 0.75f, 12.125f, 1000.5f};
+  const float gains[] = {-2.5f, -0.0123f, 0.0005f, 0.57f, 1.0f, 3.25f};
+  for (float v : values) {
+    for (float g : gains) {
+      float expected = v * g;
+      TEST_ASSERT_FLOAT_WITHIN(0.0001f, expected, float(fixed_real(v) * fixed_coeff(g)));
+    }
+  }
+}
+
+// float and fixed agree exactly in sign and, below MAX_TERM_VOLTS, in size
+static void check_saturates_like_float(float fixed, float expected) {
+  if (fabsf(expected) < MAX_TERM_VOLTS) {
+    TEST_ASSERT_FLOAT_WITHIN(fabsf(expected) * 0.001f + 0.01f, expected, fixed);
+    return;
+  }
+  TEST_ASSERT_TRUE(expected > 0 ? fixed >= MAX_TERM_VOLTS * 0.99f : fixed <= -MAX_TERM_VOLTS * 0.99f);
+}
+
+void test_large_gains_saturate(void) {
+  FloatGains float_gains;
+  FixedGains fixed_gains;
+  float_gains.load(MAX_KP, MAX_KD, SPEED_FF, MAX_ACC_FF, 0, DEG_PER_COUNT, MAX_FREQUENCY);
+  fixed_gains.load(MAX_KP, MAX_KD, SPEED_FF, MAX_ACC_FF, 0, DEG_PER_COUNT, MAX_FREQUENCY);
+  // a following error of 1090 counts is enough to wrap the P term
+  const float errors[] = {-20000, -1500, -1090, -100, 0, 100, 1090, 1500, 20000};
+  for (float e : errors) {
+    check_saturates_like_float(float(fixed_gains.position_output(e, 0)), float_gains.position_output(e, 0));
+  }
+  // with Kd at its limit a difference of 3 counts in one tick wraps the D term
+  const float diffs[] = {-50, -3, -2, -0.5f, 0.5f, 2, 3, 50};
+  for (float d : diffs) {
+    check_saturates_like_float(float(fixed_gains.position_output(0, d)), float_gains.position_output(0, d));
+  }
+  // and the same for accFF with a hard acceleration
+  const float accelerations[] = {-20, -3, 3, 20};
+  for (float a : accelerations) {
+    float expected = float_gains.feed_forward(0, a, BIAS_THRESHOLD);
+    check_saturates_like_float(float(fixed_gains.feed_forward(0, a, BIAS_THRESHOLD)), expected);
+  }
+}
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_move_volts_match);
+  RUN_TEST(test_multiply_matches_float);
+  RUN_TEST(test_large_gains_saturate);
+  return UNITY_END();
+}
@@ -35,7 +35,16 @@
 #include "commands.h"
 #include "config.h"
 #include "src/adc.h"
+#include "src/capture.h"
+#include "src/cli.h"
+#include "src/parameters.h"
+#include "src/protocol.h"
+#include "src/ram.h"
+#include "src/scheduler.h"
 #include "src/settings.h"
+#include "src/setpoints.h"
+#include "src/systick.h"
+#include "src/timing.h"
 #include "src/types.h"
 #include <Arduino.h>
 
@@ -44,59 +53,257 @@ cli_status_t send_id(const Args &args) {
   return CLI_OK;
 }
 
+/***
+ * Some things must not change under a running trial, or start while a
+ * trial or a capture dump is sending its rows. Those commands call this
+ * first and give up if it returns true.
+ */
+static bool busy(const Args &args) {
+  if (!robot.trial_running() && !capture.is_dumping()) {
+    return false;
+  }
+  Serial.print(args.argv[0]);
+  Serial.println(F(" - busy, use ABORT"));
+  return true;
+}
+
 cli_status_t init_settings(const Args &args) {
+  if (busy(args)) {
+    return CLI_E_IO;
+  }
   settings.init(defaults);
+  systick.set_frequency(settings.data.loopHz);
+  motors.load_coefficients();
+  encoders.load_coefficients();
   return cli_status_t();
 }
 
 cli_status_t print_settings(const Args &args) {
-  settings.print();
+  print_parameters();
   return cli_status_t();
 }
 
-cli_status_t set_get_km(const Args &args) {
-  cmdSetGet(settings.data.Km, 0.0f, 10000.0f, args, 1);
-  return cli_status_t();
+/***
+ * Recalculate whatever depends on the parameters that changed. Returns
+ * false if the new loop frequency was not allowed. It is left as it was.
+ */
+static bool apply_parameter_changes(uint8_t changes) {
+  bool ok = true;
+  if (changes & PARAM_RELOAD_LOOP) {
+    // this reloads the motor and encoder coefficients as well
+    ok = systick.set_frequency(settings.data.loopHz);
+    settings.data.loopHz = loop_time.frequency();
+  }
+  if (changes & PARAM_RELOAD_MOTORS) {
+    motors.load_coefficients();
+  }
+  if (changes & PARAM_RELOAD_ENCODERS) {
+    encoders.load_coefficients();
+  }
+  return ok;
 }
 
-cli_status_t set_get_tm(const Args &args) {
-  cmdSetGet(settings.data.Tm, 0.0f, 10.0f, args, 6);
-  return cli_status_t();
-}
-
-cli_status_t set_get_kp(const Args &args) {
-  cmdSetGet(settings.data.Kp, 0.0f, 10.0f, args, 6);
-  return cli_status_t();
+// the loop frequency is left alone while a trial runs
+static uint8_t change_parameter(uint8_t index, float value) {
+  if (robot.trial_running() && (pgm_read_byte(&PARAMETERS[index].flags) & PARAM_RELOAD_LOOP)) {
+    return 0;
+  }
+  return set_parameter(index, value);
 }
 
-cli_status_t set_get_kd(const Args &args) {
-  cmdSetGet(settings.data.Kd, 0.0f, 10.0f, args, 6);
-  return cli_status_t();
+/***
+ * NAME [value] [NAME value]...
+ *
+ * Any parameter from the table in parameters.h, optionally with a new
+ * value. Several names can go on one line, each with or without a
+ * value. A name followed by another name is just read. A value that is
+ * not a number, or has anything after the number, rejects the whole
+ * line and nothing is changed. All the
+ * values are stored before anything that depends on them is
+ * recalculated and then each one is printed. Anything that is not a
+ * parameter name is passed back so that the CLI can report it.
+ */
+cli_status_t set_get_parameters(const Args &args) {
+  if (find_parameter(args.argv[0]) < 0) {
+    return CLI_E_CMD_NOT_FOUND;
+  }
+  static_assert(MAX_ARGC <= 16, "one bit per argument");
+  uint16_t with_value = 0; // one bit for each name that is followed by a value
+  float value;
+  for (int i = 0; i + 1 < args.argc; i++) {
+    if (find_parameter(args.argv[i]) < 0 || find_parameter(args.argv[i + 1]) >= 0) {
+      continue;
+    }
+    if (!read_whole_float(args.argv[i + 1], value)) {
+      Serial.print(args.argv[i + 1]);
+      Serial.println(F(" is not a number"));
+      return CLI_E_INVALID_ARGS;
+    }
+    with_value |= 1 << i;
+    i++;
+  }
+  uint8_t changes = 0;
+  for (int i = 0; i < args.argc; i++) {
+    if (with_value & (1 << i)) {
+      read_whole_float(args.argv[i + 1], value);
+      changes |= change_parameter(find_parameter(args.argv[i]), value);
+      i++;
+    }
+  }
+  if (!apply_parameter_changes(changes)) {
+    Serial.println(F("Use 250, 500, 1000 or 2000"));
+  }
+  for (int i = 0; i < args.argc; i++) {
+    Serial.print(args.argv[i]);
+    int8_t param = find_parameter(args.argv[i]);
+    if (param < 0) {
+      Serial.println(F(" ?"));
+      continue;
+    }
+    Serial.print(F(" = "));
+    print_parameter(param);
+    Serial.println();
+    if (with_value & (1 << i)) {
+      i++;
+    }
+  }
+  return CLI_OK;
 }
 
-cli_status_t set_get_zeta(const Args &args) {
-  cmdSetGet(settings.data.zeta, 0.0f, 10.0f, args, 6);
+cli_status_t set_get_pwm_bits(const Args &args) {
+  if (args.argc > 1 && !busy(args)) {
+    if (!motors.set_pwm_resolution(atoi(args.argv[1]))) {
+      Serial.println(F("Use 8, 9 or 10"));
+    }
+  }
+  Serial.print(args.argv[0]);
+  Serial.print(F(" = "));
+  Serial.println(motors.pwm_bits());
   return cli_status_t();
 }
 
-cli_status_t set_get_td(const Args &args) {
-  cmdSetGet(settings.data.Td, 0.0f, 1.0f, args, 6);
+/***
+ * TELEM mode [interval]
+ *
+ * TELEM 1 for binary controller reports, TELEM 0 for text. The reports
+ * send one row every interval ticks. Binary reports send every tick and
+ * text reports every REPORTING_INTERVAL ticks unless the interval is
+ * given. The reply is the mode and interval followed by the counters
+ * for the last trial: rows sent, rows dropped because the serial port
+ * was busy and samples missed because the main loop was held up.
+ */
+cli_status_t set_get_telemetry(const Args &args) {
+  if (args.argc > 1 && !busy(args)) {
+    bool binary = atoi(args.argv[1]);
+    reporter.set_binary(binary);
+    reporter.set_report_interval(binary ? 1 : REPORTING_INTERVAL);
+    if (args.argc > 2) {
+      reporter.set_report_interval(constrain(atoi(args.argv[2]), 1, 255));
+    }
+  }
+  Serial.print(args.argv[0]);
+  Serial.print(F(" = "));
+  Serial.print(reporter.is_binary());
+  Serial.print(' ');
+  Serial.print(reporter.report_interval());
+  Serial.print(' ');
+  Serial.print(reporter.rows_sent());
+  Serial.print(' ');
+  Serial.print(reporter.rows_dropped());
+  Serial.print(' ');
+  Serial.println(reporter.missed_samples());
   return cli_status_t();
 }
 
-cli_status_t set_get_bias_ff(const Args &args) {
-  cmdSetGet(settings.data.biasFF, 0.0f, 10.0f, args, 3);
+/***
+ * CAPTURE [divisor] [mask]
+ *
+ * With arguments, arm the capture for the next trial, recording one
+ * sample every divisor ticks. The bits in mask choose the channels.
+ * See src/capture.h. The reply is the state, the channel mask, the
+ * divisor and the samples recorded out of the number that will fit.
+ */
+cli_status_t do_capture(const Args &args) {
+  if (args.argc > 1 && capture.is_dumping()) {
+    Serial.println(F("dump running"));
+    return CLI_E_IO;
+  }
+  if (args.argc > 1) {
+    uint8_t divisor = constrain(atoi(args.argv[1]), 1, 255);
+    uint8_t mask = capture.mask();
+    if (args.argc > 2) {
+      mask = atoi(args.argv[2]);
+    }
+    if (!capture.set_channels(mask, divisor)) {
+      Serial.println(F("no channels"));
+      return cli_status_t();
+    }
+    capture.arm();
+  }
+  Serial.print(capture.state());
+  Serial.print(' ');
+  Serial.print(capture.mask());
+  Serial.print(' ');
+  Serial.print(capture.divisor());
+  Serial.print(' ');
+  Serial.print(capture.samples());
+  Serial.print('/');
+  Serial.println(capture.capacity());
   return cli_status_t();
 }
 
-cli_status_t set_get_speed_ff(const Args &args) {
-  cmdSetGet(settings.data.speedFF, 0.0f, 10.0f, args, 5);
+/***
+ * TRIG source condition level [pre]
+ * TRIG OFF
+ *
+ * Start a triggered capture, with the channels and divisor set by the
+ * last CAPTURE command. The source is a channel name or STATE for the
+ * profile state and the condition is ABOVE, BELOW, OUTSIDE or EQUAL.
+ * pre is the percentage of the buffer to keep from before the trigger.
+ * TRIG OFF stops the capture. The reply is the capture state, the
+ * trigger and the samples recorded.
+ */
+cli_status_t do_trigger(const Args &args) {
+  if (args.argc > 1 && capture.is_dumping()) {
+    Serial.println(F("dump running"));
+    return CLI_E_IO;
+  }
+  if (args.argc == 2 && strcmp_P(args.argv[1], PSTR("OFF")) == 0) {
+    capture.disarm();
+  } else if (args.argc > 3) {
+    int8_t source = find_name(args.argv[1], CAPTURE_NAMES, CAPTURE_NAME_WIDTH, CAP_CHANNEL_COUNT + 1);
+    int8_t condition = find_name(args.argv[2], TRIGGER_NAMES, TRIGGER_NAME_WIDTH, TRIG_CONDITION_COUNT);
+    if (source < 0 || condition < 0) {
+      Serial.println(F("bad trigger"));
+      return cli_status_t();
+    }
+    uint8_t pre = 50;
+    if (args.argc > 4) {
+      pre = constrain(atoi(args.argv[4]), 0, 100);
+    }
+    capture.arm_trigger(source, condition, atof(args.argv[3]), pre);
+  }
+  Serial.print(capture.state());
+  Serial.print(' ');
+  capture.print_trigger();
+  Serial.print(' ');
+  Serial.print(capture.samples());
+  Serial.print('/');
+  Serial.println(capture.capacity());
   return cli_status_t();
 }
 
-cli_status_t set_get_acc_ff(const Args &args) {
-  cmdSetGet(settings.data.accFF, 0.0f, 10.0f, args, 6);
-  return cli_status_t();
+// print whatever the last capture recorded. The rows go out from the main loop
+cli_status_t do_dump(const Args &args) {
+  if (capture.is_recording()) {
+    Serial.println(F("capture running"));
+    return cli_status_t();
+  }
+  if (busy(args)) {
+    return CLI_E_IO;
+  }
+  capture.start_dump();
+  return CLI_RUNNING;
 }
 
 cli_status_t write_settings(const Args &args) {
@@ -105,7 +312,18 @@ cli_status_t write_settings(const Args &args) {
 }
 
 cli_status_t read_settings(const Args &args) {
-  settings.read();
+  if (busy(args)) {
+    return CLI_E_IO;
+  }
+  if (!settings.read()) {
+    Serial.println(F("No valid settings in EEPROM - defaults restored"));
+    settings.init(defaults);
+  }
+  if (!systick.set_frequency(settings.data.loopHz)) {
+    settings.data.loopHz = loop_time.frequency();
+  }
+  motors.load_coefficients();
+  encoders.load_coefficients();
   return cli_status_t();
 }
 
@@ -122,22 +340,322 @@ cli_status_t get_battery_volts(const Args &args) {
   return cli_status_t();
 }
 
+// the filtered reading of every channel in the ADC scan list
+cli_status_t get_adc_readings(const Args &args) {
+  for (uint8_t i = 0; i < ADC_CHANNEL_COUNT; i++) {
+    Serial.print(ADC_CHANNELS[i]);
+    Serial.print(F(": "));
+    Serial.println(adc.get_reading(i));
+  }
+  return cli_status_t();
+}
+
+/***
+ * CURRENT 1 runs the motor under current control. CURRENT 0 goes back
+ * to voltage control. Either way, the current is reported.
+ */
+#if CURRENT_SENSE
+cli_status_t set_get_current_loop(const Args &args) {
+  if (args.argc > 1) {
+    if (atoi(args.argv[1])) {
+      current_loop.enable();
+    } else {
+      current_loop.disable();
+    }
+  }
+  Serial.print(args.argv[0]);
+  Serial.print(F(" = "));
+  Serial.print(current_loop.is_enabled());
+  Serial.print(F(" demand "));
+  Serial.print(current_loop.demand(), 3);
+  Serial.print(F("A measured "));
+  Serial.print(current_loop.current(), 3);
+  Serial.println('A');
+  return cli_status_t();
+}
+#endif
+
+/***
+ * The trials only start the robot off. They run from loop() so the
+ * prompt comes once they have finished. See robot.h
+ */
 cli_status_t do_move(const Args &args) {
+  if (busy(args)) {
+    return CLI_E_IO;
+  }
   robot.do_move_trial(args);
+  return CLI_RUNNING;
+}
+
+cli_status_t do_queue(const Args &args) {
+  if (busy(args)) {
+    return CLI_E_IO;
+  }
+  robot.do_queue_trial(args);
+  return robot.trial_running() ? CLI_RUNNING : CLI_E_INVALID_ARGS;
+}
+
+/***
+ * STREAM ON clears the buffer and waits for setpoints. STREAM OFF
+ * stops the stream and the motor. Neither is allowed while a trial
+ * runs. Either way, or with no argument, the state, buffer fill and
+ * underrun count are printed.
+ */
+cli_status_t do_stream(const Args &args) {
+  if (args.argc > 1) {
+    if (strcmp_P(args.argv[1], PSTR("ON")) == 0) {
+      if (busy(args)) {
+        return CLI_E_IO;
+      }
+      robot.start_stream();
+    } else if (setpoints.is_active()) {
+      robot.stop_stream();
+    } else if (busy(args)) {
+      return CLI_E_IO; // stop_stream() would stop the trial drive
+    }
+  }
+  Serial.print(setpoints.state());
+  Serial.print(' ');
+  Serial.print(setpoints.fill());
+  Serial.print('/');
+  Serial.print(setpoints.size());
+  Serial.print(' ');
+  Serial.println(setpoints.underruns());
+  return cli_status_t();
+}
+
+/***
+ * SP position speed [position speed]...
+ *
+ * Positions are in degrees and speeds in deg/s. The reply is the
+ * buffer fill and underrun count for flow control. Anything that
+ * does not fit in the buffer is dropped and the reply starts with '!'.
+ */
+cli_status_t add_setpoints(const Args &args) {
+  bool dropped = false;
+  for (int i = 1; i + 1 < args.argc; i += 2) {
+    if (!setpoints.add(atof(args.argv[i]), atof(args.argv[i + 1]))) {
+      dropped = true;
+    }
+  }
+  if (dropped) {
+    Serial.print('!');
+  }
+  Serial.print(setpoints.fill());
+  Serial.print(' ');
+  Serial.println(setpoints.underruns());
   return cli_status_t();
 }
 
 cli_status_t do_step(const Args &args) {
+  if (busy(args)) {
+    return CLI_E_IO;
+  }
   robot.do_step_trial(args);
-  return cli_status_t();
+  return CLI_RUNNING;
 }
 
 cli_status_t do_encoders(const Args &args) {
   // add a function to calibrat ethe encoder/gearbox resolution
+  robot.show_encoders(args);
   return cli_status_t();
 }
 
 cli_status_t do_open_loop(const Args &args) {
+  if (busy(args)) {
+    return CLI_E_IO;
+  }
   robot.do_open_loop_trial(args);
+  return CLI_RUNNING;
+}
+
+// stop any trial or setpoint stream with the motor off
+cli_status_t do_abort(const Args &args) {
+  robot.abort_trial();
+  return CLI_OK;
+}
+
+cli_status_t report_load(const Args &args) {
+  isr_timing.print();
+  isr_timing.reset();
   return cli_status_t();
 }
+
+cli_status_t report_tasks(const Args &args) {
+  scheduler.print();
+  scheduler.reset();
+  return cli_status_t();
+}
+
+// in bytes. See src/ram.h
+cli_status_t report_ram(const Args &args) {
+  Serial.print(F("static "));
+  Serial.println(static_ram());
+  Serial.print(F("stack max "));
+  Serial.println(stack_high_water());
+  Serial.print(F("never used "));
+  Serial.println(unused_ram());
+  return CLI_OK;
+}
+
+/***
+ * The trials that can be started with a binary TRIAL_START request.
+ * The trial number is the row in this table.
+ */
+struct BinaryTrial {
+  char name[8];
+  cmd_func_ptr_t run;
+};
+
+const BinaryTrial BINARY_TRIALS[] PROGMEM = {
+  {"MOVE", do_move},
+  {"STEP", do_step},
+  {"QMOVE", do_queue},
+  {"VOLTS", do_open_loop},
+  {"STREAM", do_stream},
+};
+
+const uint8_t BINARY_TRIAL_COUNT = sizeof(BINARY_TRIALS) / sizeof(BINARY_TRIALS[0]);
+
+static void binary_param_read(Response &response, const uint8_t *payload, uint8_t size) {
+  uint8_t first = 0;
+  uint8_t count = PARAMETER_COUNT;
+  if (size == 2) {
+    first = payload[0];
+    count = payload[1];
+  } else if (size != 0) {
+    response.nak(NAK_LENGTH);
+    return;
+  }
+  if (first >= PARAMETER_COUNT) {
+    response.nak(NAK_ARGUMENT);
+    return;
+  }
+  count = min(count, PARAMETER_COUNT - first);
+  count = min(count, (response.space() - 2) / 4);
+  response.add_byte(first);
+  response.add_byte(count);
+  for (uint8_t i = first; i < first + count; i++) {
+    response.add_float(get_parameter(i));
+  }
+}
+
+// all the ids are checked before any value is stored
+static void binary_param_write(Response &response, const uint8_t *payload, uint8_t size) {
+  const uint8_t pair_size = 5;
+  if (size == 0 || size % pair_size) {
+    response.nak(NAK_LENGTH);
+    return;
+  }
+  for (uint8_t i = 0; i < size; i += pair_size) {
+    if (payload[i] >= PARAMETER_COUNT) {
+      response.nak(NAK_ARGUMENT);
+      return;
+    }
+  }
+  uint8_t changes = 0;
+  for (uint8_t i = 0; i < size; i += pair_size) {
+    float value;
+    memcpy(&value, payload + i + 1, sizeof(value));
+    changes |= change_parameter(payload[i], value);
+  }
+  apply_parameter_changes(changes);
+  for (uint8_t i = 0; i < size; i += pair_size) {
+    response.add_byte(payload[i]);
+    response.add_float(get_parameter(payload[i]));
+  }
+}
+
+static void binary_capture_info(Response &response) {
+  response.add_byte(capture.state());
+  response.add_byte(capture.mask());
+  response.add_byte(capture.divisor());
+  response.add_uint16(capture.samples());
+  response.add_uint16(capture.capacity());
+  response.add_uint16(capture.trigger_offset());
+  response.add_byte(capture.trigger_lag());
+}
+
+static void binary_capture_read(Response &response, const uint8_t *payload, uint8_t size) {
+  if (size != 3) {
+    response.nak(NAK_LENGTH);
+    return;
+  }
+  if (capture.is_recording()) {
+    response.nak(NAK_BUSY);
+    return;
+  }
+  uint16_t first = payload[0] | (payload[1] << 8);
+  uint16_t values = capture.samples() * bit_count(capture.mask());
+  if (first > values) {
+    response.nak(NAK_ARGUMENT);
+    return;
+  }
+  uint16_t count = min(payload[2], values - first);
+  count = min(count, (response.space() - 2) / 2);
+  response.add_uint16(first);
+  for (uint16_t i = first; i < first + count; i++) {
+    response.add_int16(capture.value_at(i));
+  }
+}
+
+/***
+ * Handle a binary request from the CLI. The frame is decoded in place.
+ * See src/protocol.h for the layout.
+ */
+cli_status_t do_binary_command(uint8_t *frame, uint8_t length) {
+  uint8_t size = cobs_decode(frame, length, frame);
+  Response response(frame[0], frame[1]);
+  if (size < 3 || crc8(frame, size - 1) != frame[size - 1]) {
+    response.nak(NAK_FRAME);
+    response.send();
+    return CLI_OK;
+  }
+  uint8_t *payload = frame + 2;
+  size -= 3;
+  switch (frame[1]) {
+    case OP_PING:
+      response.add_byte(PROTOCOL_VERSION);
+      response.add_byte(PARAMETER_COUNT);
+      break;
+    case OP_PARAM_READ:
+      binary_param_read(response, payload, size);
+      break;
+    case OP_PARAM_WRITE:
+      binary_param_write(response, payload, size);
+      break;
+    case OP_TRIAL_START: {
+      if (size < 1 || payload[0] >= BINARY_TRIAL_COUNT) {
+        response.nak(size < 1 ? NAK_LENGTH : NAK_ARGUMENT);
+        break;
+      }
+      if (robot.trial_running() || capture.is_dumping()) {
+        response.nak(NAK_BUSY);
+        break;
+      }
+      response.send();
+      // the arguments are text, just as they would be typed
+      BinaryTrial trial;
+      memcpy_P(&trial, &BINARY_TRIALS[payload[0]], sizeof(trial));
+      payload[size] = 0; // over the crc
+      Args args = {0};
+      args.argv[args.argc++] = trial.name;
+      CommandLineInterface::tokenize((char *)payload + 1, args);
+      return trial.run(args);
+    }
+    case OP_TRIAL_ABORT:
+      robot.abort_trial();
+      break;
+    case OP_CAPTURE_INFO:
+      binary_capture_info(response);
+      break;
+    case OP_CAPTURE_READ:
+      binary_capture_read(response, payload, size);
+      break;
+    default:
+      response.nak(NAK_OPCODE);
+      break;
+  }
+  response.send();
+  return CLI_OK;
+}
@@ -46,42 +46,30 @@ cli_status_t read_settings(const Args &args);
 cli_status_t write_settings(const Args &args);
 cli_status_t print_settings(const Args &args);
 
-cli_status_t set_get_km(const Args &args);
-cli_status_t set_get_tm(const Args &args);
-cli_status_t set_get_kp(const Args &args);
-cli_status_t set_get_kd(const Args &args);
-cli_status_t set_get_zeta(const Args &args);
-cli_status_t set_get_td(const Args &args);
-
-cli_status_t set_get_bias_ff(const Args &args);
-cli_status_t set_get_speed_ff(const Args &args);
-cli_status_t set_get_acc_ff(const Args &args);
+cli_status_t set_get_parameters(const Args &args);
+cli_status_t set_get_pwm_bits(const Args &args);
+cli_status_t set_get_telemetry(const Args &args);
+cli_status_t do_capture(const Args &args);
+cli_status_t do_trigger(const Args &args);
+cli_status_t do_dump(const Args &args);
 
 cli_status_t get_battery_volts(const Args &args);
+cli_status_t get_adc_readings(const Args &args);
+#if CURRENT_SENSE
+cli_status_t set_get_current_loop(const Args &args);
+#endif
 cli_status_t do_move(const Args &args);
+cli_status_t do_stream(const Args &args);
+cli_status_t add_setpoints(const Args &args);
 cli_status_t do_step(const Args &args);
+cli_status_t do_queue(const Args &args);
 cli_status_t do_encoders(const Args &args);
 cli_status_t do_open_loop(const Args &args);
+cli_status_t do_abort(const Args &args);
+cli_status_t report_load(const Args &args);
+cli_status_t report_tasks(const Args &args);
+cli_status_t report_ram(const Args &args);
 
 cli_status_t action(const Args &args);
 
-/***
- * this function template allows us to get or set the value
- * of any variable regardless of type
- */
-
-template <class T>
-void cmdSetGet(T &var, T min, T max, const Args &args, int dp = 2) {
-  if (args.argc > 1) {
-    var = atof(args.argv[1]);
-    if (var > max) {
-      var = max;
-    }
-    if (var < min) {
-      var = min;
-    }
-  }
-  Serial.print(args.argv[0]);
-  Serial.print(F(" = "));
-  Serial.println(var, dp);
-}
\ No newline at end of file
+cli_status_t do_binary_command(uint8_t *frame, uint8_t length);
@@ -42,8 +42,8 @@ const float MAX_MOTOR_VOLTS = 6.0;
 
 //***************************************************************************//
 
-// time between logged lined when reporting is enabled (milliseconds)
-const int REPORTING_INTERVAL = 10;
+// ticks between logged lines when reporting is enabled. 10ms at 500Hz
+const uint8_t REPORTING_INTERVAL = 5;
 
 //** STEP 2 DRIVETRAIN ******************************************************//
 // Enter these before starting
@@ -115,6 +115,16 @@ const float ACC_FF = Tm / Km;
 const float BIAS_FF = 0.145;
 const float TOP_SPEED = (6.0 - BIAS_FF) / SPEED_FF;
 
+/***
+ * Only used with current sensing. See CURRENT_SENSE in config.h
+ * The winding resistance turns the controller output into a current
+ * demand. Measure it across the motor terminals with the rotor held.
+ * The current loop gains are in Volts per Amp and Volts per Amp second.
+ */
+const float MOTOR_RESISTANCE = 5.0;
+const float CURRENT_KP = 2.0;
+const float CURRENT_KI = 2000.0;
+
 // profile motion controller constants
 /***
  * The PD controller is u = Kp * e + Kd*(e - e_old)
@@ -64,17 +64,87 @@ const int MOTOR_PWM = 10;
 const int BATTERY_ADC_PIN = A7;
 const int BATTERY_CHANNEL = 7;
 
+/***
+ * The ADC scanner converts these channels in turn, every tick. The
+ * battery must be the first. Add channels for anything else with an
+ * analogue output, such as a current sense resistor or a potentiometer.
+ *
+ * Each channel is sampled 4^ADC_OVERSAMPLE_BITS times and decimated to
+ * give ADC_OVERSAMPLE_BITS extra bits of resolution. The result is then
+ * low pass filtered with a time constant of 2^ADC_FILTER_SHIFT scans.
+ * See src/adc.h
+ */
+const uint8_t ADC_CHANNELS[] = {BATTERY_CHANNEL};
+const uint8_t ADC_OVERSAMPLE_BITS = 2;
+const uint8_t ADC_FILTER_SHIFT = 3;
+
+/***
+ * RAM set aside for the capture buffer. The ATmega328 has only 2k of
+ * RAM and the stack needs a few hundred bytes of what is left, more
+ * while a binary frame is being answered. Check what the RAM command
+ * says is never used before making this any larger. 384 bytes holds
+ * 27 samples of the default channels. See src/capture.h
+ */
+const uint16_t CAPTURE_BUFFER_BYTES = 384;
+
+/***
+ * The main loop warns when the battery falls below this. Two cell
+ * LiPo packs should not be run down much further.
+ */
+const float BATTERY_LOW_VOLTS = 6.4f;
+
+/***
+ * Set CURRENT_SENSE to 1 if the motor driver has an analogue current
+ * sense output connected to CURRENT_CHANNEL. The sensor must be
+ * bidirectional with zero current at CURRENT_ZERO_COUNTS.
+ *
+ * The current is then sampled, and the inner current loop run,
+ * CURRENT_LOOP_RATIO times every tick. Each sample is taken in the
+ * middle of a PWM pulse. The CURRENT command turns the current loop
+ * on and off. See src/current.h
+ */
+#define CURRENT_SENSE 0
+const uint8_t CURRENT_CHANNEL = 6;
+const uint8_t CURRENT_LOOP_RATIO = 4;
+const float CURRENT_SENSE_VOLTS_PER_AMP = 0.5f;
+const int CURRENT_ZERO_COUNTS = 512;
+
 /***
  * these are the defaults for some system-wide settings regardless of the robot
  * or environment. It would be best not to mess with these without good reason.
  * Sometimes the controller needs the interval, sometimes the frequency
  * define one and pre-calculate the other. The compiler does the work and no flash or
  * RAM storage is used. Constants are used for better type checking and traceability.
+ *
+ * The loop frequency is only the default. It can be changed at run time to
+ * 250, 500, 1000 or 2000Hz with `loopHz <hz>`. See src/looptime.h
  */
 
 const float LOOP_FREQUENCY = 500.0f;
 const float LOOP_INTERVAL = (1.0f / LOOP_FREQUENCY);
 
+/***
+ * The control code in the systick ISR can use either float or fixed
+ * point arithmetic. Fixed point is much faster on the ATmega328 which
+ * has no floating point hardware. Set this to 0 to go back to float,
+ * for example to compare the two. See src/fixed.h for details.
+ */
+#define CONTROL_FIXED_POINT 1
+
+/***
+ * Set this to 1 to include the encoder interrupt in the LOAD report.
+ * The measurement costs more than the decoding so it is off by default.
+ */
+#define ENCODER_ISR_TIMING 0
+
+/***
+ * The motor PWM resolution at startup. Use 8, 9 or 10 bits. More bits
+ * give finer control of the motor voltage at the cost of a lower PWM
+ * frequency: 31.25kHz, 15.6kHz or 7.8kHz. It can be changed at run
+ * time with the PWMBITS command. See src/motors.h
+ */
+const uint8_t PWM_BITS = 8;
+
 /*************************************************************************/
 /***
  * Since you may build for different physical robots, their characteristics
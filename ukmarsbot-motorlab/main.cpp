@@ -1,112 +1,236 @@
-/*
- * File: mazerunner.ino
- * Project: mazerunner
- * File Created: Monday, 5th April 2021 8:38:15 am
- * Author: Peter Harrison
- * -----
- * Last Modified: Thursday, 8th April 2021 8:38:41 am
- * Modified By: Peter Harrison
- * -----
- * MIT License
- *
- * Copyright (c) 2021 Peter Harrison
- *
- * Permission is hereby granted, free of charge, to any person obtaining a copy of
- * this software and associated documentation files (the "Software"), to deal in
- * the Software without restriction, including without limitation the rights to
- * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
- * of the Software, and to permit persons to whom the Software is furnished to do
- * so, subject to the following conditions:
- *
- * The above copyright notice and this permission notice shall be included in all
- * copies or substantial portions of the Software.
- *
- * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
- * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
- * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
- * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
- * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
- * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
- * SOFTWARE.
- */
-#include "commands.h"
-#include "config.h"
-#include "reports.h"
-#include "robot.h"
-#include "src/adc.h"
-#include "src/cli.h"
-#include "src/encoders.h"
-#include "src/motors.h"
-#include "src/settings.h"
-#include "src/systick.h"
-#include <Arduino.h>
-
-// Global objects
-Systick systick;
-AnalogueConverter adc;
-Encoders encoders;
-// Sensors sensors;
-Motors motors;
-Profile profile;
-Settings settings;
-Robot robot;
-CommandLineInterface cli;
-Reporter reporter;
-
-void setup() {
-  Serial.begin(BAUDRATE);
-  adc.init();
-  systick.begin();
-  pinMode(LED_BUILTIN, OUTPUT);
-  settings.init(defaults);
-  motors.setup();
-  encoders.setup();
-
-  Serial.println(F("MOTORLAB 1.0"));
-
-  cli.add_cmd(send_id, PSTR("*IDN?"), PSTR("Request robot ID"));
-  cli.add_cmd(print_settings, PSTR("$"), PSTR("Display all Setting"));
-  cli.add_cmd(write_settings, PSTR("!"), PSTR("Write settings to EEPROM"));
-  cli.add_cmd(read_settings, PSTR("@"), PSTR("Read settings from EEPROM"));
-  cli.add_cmd(init_settings, PSTR("#"), PSTR("Initialise settings to defaults"));
-  cli.add_cmd(set_get_km, PSTR("KM"), PSTR("Set/Get Km"));
-  cli.add_cmd(set_get_tm, PSTR("TM"), PSTR("Set/Get Tm"));
-  cli.add_cmd(set_get_kp, PSTR("KP"), PSTR("Set/Get Kp"));
-  cli.add_cmd(set_get_kd, PSTR("KD"), PSTR("Set/Get Kd"));
-  cli.add_cmd(set_get_zeta, PSTR("ZETA"), PSTR("Set/Get Damping Ratio, zeta"));
-  cli.add_cmd(set_get_td, PSTR("TD"), PSTR("Set/Get settling time, Td"));
-  cli.add_cmd(set_get_bias_ff, PSTR("BIASFF"), PSTR("Set/Get bias feed forward"));
-  cli.add_cmd(set_get_speed_ff, PSTR("SPEEDFF"), PSTR("Set/Get speed feedforward"));
-  cli.add_cmd(get_battery_volts, PSTR("BATT"), PSTR("Get battery Voltage"));
-  cli.add_cmd(do_move, PSTR("MOVE"), PSTR("Execute move profile"));
-  cli.add_cmd(do_step, PSTR("STEP"), PSTR("Execute single step"));
-  cli.add_cmd(do_encoders, PSTR("ENC"), PSTR("Set/Get KM"));
-  cli.add_cmd(do_open_loop, PSTR("VOLTS"), PSTR("Execute open loop"));
-  cli.prompt();
-}
-
-void loop() {
-  if (cli.read_serial() > 0) {
-    cli.interpret_line();
-  }
-}
-
-/**
- * Measurements indicate that even at 1500mm/s the total load due to
- * the encoder interrupts is less than 3% of the available bandwidth.
- */
-
-// INT1 will respond to the XOR-ed pulse train from the right encoder
-// runs in constant time of around 3us per interrupt.
-// would be faster with direct port access
-ISR(INT1_vect) {
-  encoders.encoder_input_change();
-}
-
-ISR(TIMER2_COMPA_vect, ISR_NOBLOCK) {
-  systick.update();
-}
-
-ISR(ADC_vect) {
-  adc.update_channel();
-}
+/*
+ * File: mazerunner.ino
+ * Project: mazerunner
+ * File Created: Monday, 5th April 2021 8:38:15 am
+ * Author: Peter Harrison
+ * -----
+ * Last Modified: Thursday, 8th April 2021 8:38:41 am
+ * Modified By: Peter Harrison
+ * -----
+ * MIT License
+ *
+ * Copyright (c) 2021 Peter Harrison
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include "commands.h"
+#include "config.h"
+#include "reports.h"
+#include "robot.h"
+#include "src/adc.h"
+#include "src/capture.h"
+#include "src/cli.h"
+#include "src/current.h"
+#include "src/encoders.h"
+#include "src/looptime.h"
+#include "src/motors.h"
+#include "src/ram.h"
+#include "src/scheduler.h"
+#include "src/settings.h"
+#include "src/snapshot.h"
+#include "src/setpoints.h"
+#include "src/systick.h"
+#include "src/timing.h"
+#include <Arduino.h>
+
+// Global objects
+LoopTime loop_time;
+Systick systick;
+AnalogueConverter adc;
+Encoders encoders;
+// Sensors sensors;
+Motors motors;
+Profile profile;
+SetpointStream setpoints;
+ControlSnapshot snapshot;
+Capture capture;
+#if CURRENT_SENSE
+CurrentLoop current_loop;
+#endif
+Settings settings;
+Robot robot;
+CommandLineInterface cli;
+Reporter reporter;
+IsrTiming isr_timing;
+Scheduler scheduler;
+
+/***
+ * The main loop tasks. See src/scheduler.h. None of them waits for
+ * anything. The trial and the capture dump give the prompt back to the
+ * CLI when they are done.
+ */
+void loop_trials() {
+  if (robot.update()) {
+    cli.command_finished();
+  }
+}
+
+void loop_report() {
+  reporter.update();
+}
+
+void loop_cli() {
+  if (cli.read_serial() > 0) {
+    cli.interpret_line();
+  }
+}
+
+void loop_dump() {
+  if (capture.dump_rows()) {
+    cli.command_finished();
+  }
+}
+
+/***
+ * The battery compensation is worked out here rather than in systick
+ * because it needs a divide. It is done often enough to follow the
+ * battery as it sags under load.
+ *
+ * Warn once in any trial where the battery is low. The report treats
+ * the warning as a comment.
+ */
+void loop_battery() {
+  static bool warned = false;
+  adc.update_battery();
+  motors.set_battery_compensation(adc.get_battery_comp());
+  if (!robot.trial_running()) {
+    warned = false;
+    return;
+  }
+  float volts = adc.get_battery_voltage();
+  if (!warned && volts < BATTERY_LOW_VOLTS) {
+    Serial.print(F("# battery low "));
+    Serial.println(volts, 2);
+    warned = true;
+  }
+}
+
+const LoopTask loop_tasks[] PROGMEM = {
+  {"trials", loop_trials, 0},
+  {"report", loop_report, 0},
+  {"cli", loop_cli, 0},
+  {"dump", loop_dump, 0},
+  {"battery", loop_battery, 20},
+};
+
+const uint8_t LOOP_TASK_COUNT = sizeof(loop_tasks) / sizeof(loop_tasks[0]);
+static_assert(LOOP_TASK_COUNT <= MAX_LOOP_TASKS, "Too many loop tasks. Increase MAX_LOOP_TASKS");
+
+/* clang-format off */
+const CliCommand cli_commands[] PROGMEM = {
+  CLI_COMMAND("*IDN?",   send_id,              "Request robot ID"),
+  CLI_COMMAND("$",       print_settings,       "Display all Setting"),
+  CLI_COMMAND("!",       write_settings,       "Write settings to EEPROM"),
+  CLI_COMMAND("@",       read_settings,        "Read settings from EEPROM"),
+  CLI_COMMAND("#",       init_settings,        "Initialise settings to defaults"),
+  CLI_COMMAND("PWMBITS", set_get_pwm_bits,     "Set/Get motor PWM resolution"),
+  CLI_COMMAND("TELEM",   set_get_telemetry,    "Set/Get binary telemetry"),
+  CLI_COMMAND("CAPTURE", do_capture,           "Arm/Show trial capture"),
+  CLI_COMMAND("TRIG",    do_trigger,           "Arm/Disarm/Show triggered capture"),
+  CLI_COMMAND("DUMP",    do_dump,              "Print captured trial"),
+  CLI_COMMAND("BATT",    get_battery_volts,    "Get battery Voltage"),
+  CLI_COMMAND("ADC",     get_adc_readings,     "Get filtered ADC readings"),
+#if CURRENT_SENSE
+  CLI_COMMAND("CURRENT", set_get_current_loop, "Set/Get current loop, show current"),
+#endif
+  CLI_COMMAND("MOVE",    do_move,              "Execute move profile"),
+  CLI_COMMAND("STEP",    do_step,              "Execute single step"),
+  CLI_COMMAND("QMOVE",   do_queue,             "Execute queued moves"),
+  CLI_COMMAND("STREAM",  do_stream,            "Follow streamed setpoints ON/OFF"),
+  CLI_COMMAND("SP",      add_setpoints,        "Add streamed setpoints"),
+  CLI_COMMAND("ENC",     do_encoders,          "Encoder count and errors"),
+  CLI_COMMAND("VOLTS",   do_open_loop,         "Execute open loop"),
+  CLI_COMMAND("ABORT",   do_abort,             "Stop any trial, motor off"),
+  CLI_COMMAND("LOAD",    report_load,          "Report and reset ISR timing"),
+  CLI_COMMAND("TASKS",   report_tasks,         "Report and reset main loop tasks"),
+  CLI_COMMAND("RAM",     report_ram,           "Report static RAM and stack use"),
+};
+/* clang-format on */
+
+const uint8_t CLI_COMMAND_COUNT = sizeof(cli_commands) / sizeof(cli_commands[0]);
+
+void setup() {
+  paint_free_ram(); // before anything else uses the stack. See src/ram.h
+  Serial.begin(BAUDRATE);
+  adc.init();
+  systick.begin();
+  pinMode(LED_BUILTIN, OUTPUT);
+  settings.init(defaults);
+  motors.setup();
+  encoders.setup();
+#if CURRENT_SENSE
+  current_loop.begin();
+#endif
+
+  Serial.println(F("MOTORLAB 1.0"));
+
+  cli.set_commands(cli_commands, CLI_COMMAND_COUNT);
+  cli.set_default_action(set_get_parameters);
+  cli.set_frame_action(do_binary_command);
+  cli.prompt();
+  scheduler.begin(loop_tasks, LOOP_TASK_COUNT);
+}
+
+void loop() {
+  scheduler.run();
+}
+
+/**
+ * Measurements indicate that even at 1500mm/s the total load due to
+ * the encoder interrupts is less than 3% of the available bandwidth.
+ */
+
+// INT1 will respond to the XOR-ed pulse train from the right encoder
+// runs in constant time. Direct port access and a lookup table keep it
+// to around 1us per interrupt, including the edge timestamp. Timing it roughly doubles that so the
+// measurement is only made if ENCODER_ISR_TIMING is set in config.h
+ISR(INT1_vect) {
+#if ENCODER_ISR_TIMING
+  uint8_t start = TCNT2;
+  encoders.encoder_input_change(loop_time.timestamp());
+  isr_timing.record(T_ENCODER_ISR, IsrTiming::elapsed_since(start));
+#else
+  encoders.encoder_input_change(loop_time.timestamp());
+#endif
+}
+
+// The tick is counted before interrupts are enabled so that the
+// encoder timestamps are always consistent. See looptime.h
+// The compare interrupt stays off until the tick is done. If a tick
+// overruns, the next one starts late rather than on top of it.
+ISR(TIMER2_COMPA_vect) {
+  loop_time.count_tick();
+  bitClear(TIMSK2, OCIE2A);
+  sei();
+  systick.update();
+  noInterrupts();
+  bitSet(TIMSK2, OCIE2A);
+}
+
+#if CURRENT_SENSE
+// paces the current samples. See src/current.h
+ISR(TIMER2_COMPB_vect) {
+  current_loop.next_sample_point();
+  adc.request_current_sample();
+}
+#endif
+
+ISR(ADC_vect) {
+  adc.update_channel();
+}
@@ -34,60 +34,182 @@
 #define LOGGER_H
 
 #include "reports.h"
+#include "src/capture.h"
 #include "src/encoders.h"
+#include "src/looptime.h"
 #include "src/motors.h"
 #include "src/profile.h"
+#include "src/snapshot.h"
+#include "src/telemetry.h"
 #include "src/utils.h"
 #include <Arduino.h>
 
+const uint8_t REPORT_LINE_LENGTH = 80;
+
+// "# dropped 65535" and the line end
+const uint8_t DROPS_LINE_LENGTH = 17;
+
+/***
+ * A text row is printed into one of these first so that its length is
+ * known before anything is sent. Anything past the end is lost.
+ */
+class LineBuffer : public Print {
+public:
+  size_t write(uint8_t c) override {
+    if (m_length >= REPORT_LINE_LENGTH) {
+      return 0;
+    }
+    m_text[m_length++] = c;
+    return 1;
+  }
+  using Print::write;
+
+  uint8_t length() { return m_length; }
+  const uint8_t *text() { return m_text; }
+
+private:
+  uint8_t m_text[REPORT_LINE_LENGTH];
+  uint8_t m_length = 0;
+};
+
 class Reporter;
 extern Reporter reporter;
 class Reporter {
 
-  uint32_t s_start_time;
-  uint32_t s_report_time;
-  uint32_t s_report_interval = REPORTING_INTERVAL;
+  uint32_t m_start_tick;
+  uint8_t m_report_interval = REPORTING_INTERVAL;
+  bool m_binary = false;
+  Telemetry m_telemetry;
+  uint16_t m_rows_sent = 0;
+  uint16_t m_rows_dropped = 0;
+  uint16_t m_drops_pending = 0; // not yet reported in the text rows
+  bool m_active = false;
 
 public:
   // note that the Serial device has a 64 character buffer and, at 115200 baud
   // 64 characters will take about 6ms to go out over the wire.
 
-  /**
-   * The profile reporter will send out a table of space separated
-   * data so that the results can be saved to a file or imported to
-   * a spreadsheet or other analyss software.
+  /***
+   * Reports are driven by the samples that systick latches every
+   * m_report_interval ticks. See snapshot.h. The report functions can
+   * be called as often as the caller likes. They send nothing unless a
+   * new sample is ready so there is exactly one row per sample and the
+   * rows are evenly spaced in time. Each row starts with the tick count
+   * since the header was sent.
    *
-   * Always send the header first because that restarts the elapsed
-   * time count.
+   * Rows never wait for the serial port. One that will not fit in the
+   * transmit buffer is dropped and counted, so a slow host or a busy
+   * link cannot hold up a trial. The next text row that goes out is
+   * preceded by a comment line with the number dropped. The row is only
+   * sent if there is room for both lines. Binary records
+   * show the drops as a gap in the sequence numbers.
    *
-   * The data includes
-   *   time        - in milliseconds since the header was sent
-   *   robotPos    - position in mm as reported by the encoders
-   *   robotAngle  - angle in degrees as reported by the encoders
-   *   fwdPos      - profile profiler setpoint in mm
-   *   fwdSpeed    - profile profiler current speed in mm/s
-   *   rotpos      - rotation profiler setpoint in deg
-   *   rotSpeed    - rotation profiler current speed in deg/s
-   *   fwdmVolts    - voltage sent to the motors for profile control
-   *   rotmVolts    - voltage sent to the motors for rotation control
+   * A sample that is still waiting to be reported when the next one is
+   * due is also dropped. That only happens if the caller is held up
+   * elsewhere. missed_samples() says how many there were.
    *
+   * The controller report runs as a task of its own in the main loop.
+   * The header starts it and stop_reporting() ends it. See update().
    */
+  void set_report_interval(uint8_t ticks) {
+    m_report_interval = max(ticks, 1);
+  }
+
+  uint8_t report_interval() { return m_report_interval; }
+
+  uint16_t missed_samples() { return snapshot.missed_samples(); }
+  uint16_t rows_sent() { return m_rows_sent; }
+  uint16_t rows_dropped() { return m_rows_dropped; }
+
+  // clear the row counts at the start of a trial
+  void reset_rows() {
+    m_rows_sent = 0;
+    m_rows_dropped = 0;
+    m_drops_pending = 0;
+  }
+
+  void start_reporting() {
+    m_start_tick = loop_time.ticks();
+    reset_rows();
+    snapshot.start_sampling(m_report_interval);
+    m_active = true;
+  }
+
+  void stop_reporting() {
+    m_active = false;
+  }
+
+  // the main loop task. Sends a controller row when one is due
+  void update() {
+    if (m_active) {
+      report_controller(profile);
+    }
+  }
+
+  /***
+   * Send the line only if it fits in the transmit buffer, along with
+   * the count of any dropped rows, which goes first as a line of its
+   * own. Lines too long to ever fit go once the buffer is empty.
+   */
+  void send_line(LineBuffer &line) {
+    uint16_t needed = line.length();
+    if (m_drops_pending) {
+      needed += DROPS_LINE_LENGTH;
+    }
+    needed = min(needed, SERIAL_TX_BUFFER_SIZE - 1);
+    if (Serial.availableForWrite() < needed) {
+      m_rows_dropped++;
+      m_drops_pending++;
+      return;
+    }
+    if (m_drops_pending) {
+      Serial.print(F("# dropped "));
+      Serial.println(m_drops_pending);
+      m_drops_pending = 0;
+    }
+    Serial.write(line.text(), line.length());
+    m_rows_sent++;
+  }
+
+  // wraps after 2^32 ticks, the same in every report
+  uint32_t elapsed_ticks(const ControlState &state) {
+    return state.tick - m_start_tick;
+  }
+
+  /***
+   * The open loop trial does not use the controllers so it times its
+   * own rows and sends them here. They are sent, or dropped, just like
+   * the controller rows.
+   */
+  void report_open_loop(uint32_t time, float volts, float speed) {
+    LineBuffer line;
+    line.print(time);
+    line.print(' ');
+    line.print(volts, 1);
+    line.print(' ');
+    line.print(speed, 1);
+    line.println();
+    send_line(line);
+  }
+
   void report_profile_header() {
-    Serial.println(F("$time robotPos robotAngle fwdPos  fwdSpeed rotpos rotSpeed fwdmVolts rotmVolts"));
-    s_start_time = millis();
-    s_report_time = s_start_time;
+    Serial.println(F("$tick robotPos robotAngle fwdPos  fwdSpeed rotpos rotSpeed fwdmVolts rotmVolts"));
+    start_reporting();
   }
 
   void report_profile() {
-    if (millis() >= s_report_time) {
-      s_report_time += s_report_interval;
-      print_justified(int(millis() - s_start_time), 6);
-      print_justified(int(encoders.robot_distance()), 6);
-      print_justified(int(profile.position()), 6);
-      print_justified(int(profile.speed()), 6);
-      print_justified(motors.get_fwd_millivolts(), 6);
-      Serial.println();
+    ControlState state;
+    if (!snapshot.take_sample(state)) {
+      return;
     }
+    LineBuffer line;
+    print_justified(line, elapsed_ticks(state), 6);
+    print_justified(line, int(state.robot_position.to_degrees()), 6);
+    print_justified(line, int(state.set_position.to_degrees()), 6);
+    print_justified(line, int(float(state.set_speed) * DEG_PER_COUNT), 6);
+    print_justified(line, int(1000 * float(state.motor_volts)), 6);
+    line.println();
+    send_line(line);
   }
 
   /**
@@ -99,7 +221,7 @@ public:
    * time count.
    *
    * The data includes
-   *   time        - in milliseconds since the header was sent
+   *   tick        - ticks since the header was sent
    *   robotPos    - position in mm as reported by the encoders
    *   robotAngle  - angle in degrees as reported by the encoders
    *   fwdPos      - profile profiler setpoint in mm
@@ -111,39 +233,65 @@ public:
    *
    */
   void report_controller_header() {
-    Serial.println(F("$time set_pos robot_pos set_speed robot_speed ctrl_volts ff_volts, motor_volts"));
-    s_start_time = millis();
-    s_report_time = s_start_time;
+    capture.start();
+    start_reporting();
+    if (m_binary) {
+      m_telemetry.reset();
+      return;
+    }
+    Serial.println(F("$tick set_pos robot_pos set_speed robot_speed ctrl_volts ff_volts, motor_volts"));
   }
 
+  /***
+   * In binary mode, each sample goes out as a telemetry record rather
+   * than a text row. See src/telemetry.h
+   */
+  void set_binary(bool binary) {
+    m_binary = binary;
+  }
+
+  bool is_binary() { return m_binary; }
+
+  // every value in a row comes from the same tick. See snapshot.h
   void report_controller(Profile &profile) {
+    ControlState state;
+    if (!snapshot.take_sample(state)) {
+      return;
+    }
+    if (m_binary) {
+      if (m_telemetry.send(state)) {
+        m_rows_sent++;
+      } else {
+        m_rows_dropped++;
+      }
+      return;
+    }
+    float setPos = state.set_position.to_degrees();
+    float robot_pos = state.robot_position.to_degrees();
+    float setSpeed = float(state.set_speed) * DEG_PER_COUNT;
+    float robot_speed = float(state.robot_speed) * DEG_PER_COUNT;
+    float ctrl_volts = float(state.ctrl_volts);
+    float ff_volts = float(state.ff_volts);
+    float motor_volts = float(state.motor_volts);
 
-    float setPos = profile.position();
-    float robot_pos = encoders.robot_distance();
-    float setSpeed = profile.speed();
-    float robot_speed = encoders.robot_speed();
-    float ctrl_volts = motors.m_ctrl_volts;
-    float ff_volts = motors.m_ff_volts;
-    float motor_volts = motors.m_motor_volts;
-    ;
-
-    Serial.print(millis() - s_start_time);
-    Serial.print(' ');
-    Serial.print(setPos);
-    Serial.print(' ');
-    Serial.print(robot_pos);
-    Serial.print(' ');
-    Serial.print(setSpeed);
-    Serial.print(' ');
-    Serial.print(robot_speed);
-    Serial.print(' ');
-    Serial.print(ctrl_volts);
-    Serial.print(' ');
-    Serial.print(ff_volts);
-    Serial.print(' ');
-    Serial.print(motor_volts);
-    Serial.print(' ');
-    Serial.println();
+    LineBuffer line;
+    line.print(elapsed_ticks(state));
+    line.print(' ');
+    line.print(setPos);
+    line.print(' ');
+    line.print(robot_pos);
+    line.print(' ');
+    line.print(setSpeed);
+    line.print(' ');
+    line.print(robot_speed);
+    line.print(' ');
+    line.print(ctrl_volts);
+    line.print(' ');
+    line.print(ff_volts);
+    line.print(' ');
+    line.print(motor_volts);
+    line.println();
+    send_line(line);
   }
 };
 
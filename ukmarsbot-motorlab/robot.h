@@ -36,10 +36,12 @@
 #include "config.h"
 #include "reports.h"
 #include "src/adc.h"
+#include "src/capture.h"
 #include "src/encoders.h"
 #include "src/motors.h"
 #include "src/profile.h"
 #include "src/settings.h"
+#include "src/setpoints.h"
 #include "src/types.h"
 #include "src/utils.h"
 
@@ -66,6 +68,7 @@ public:
    * @brief Reset profiles, counters and controllers. Motors off.
    */
   void reset_drive() {
+    setpoints.stop();
     motors.stop();
     encoders.reset();
     profile.reset();
@@ -83,8 +86,10 @@ public:
   }
 
   void show_encoders(const Args &args) {
-    encoders.reset();
-    Serial.println(F("Encoders:"));
+    Serial.print(F("Encoder count = "));
+    Serial.println(encoders.right_total());
+    Serial.print(F("Quadrature errors = "));
+    Serial.println(encoders.quad_errors());
     // something to get encoder count for one turn
   }
 
@@ -92,6 +97,103 @@ public:
     return adc.get_battery_voltage();
   }
 
+  /***
+   * The trials do not wait for anything. Each one sets up the drive,
+   * prints its header and returns. update() is then run as a task in
+   * the main loop and moves the trial on from one phase to the next.
+   * The controller reports are sent by a task of their own. Commands are still read
+   * while a trial runs so parameters can be changed, the state can be
+   * looked at and ABORT stops the motor at once.
+   *
+   * The controller trials end with a line holding just '#'.
+   */
+  bool trial_running() { return m_trial != TRIAL_IDLE && m_trial != TRIAL_DONE; }
+
+  // returns true once after each trial finishes or is aborted
+  bool update() {
+    switch (m_trial) {
+      case TRIAL_IDLE:
+        return false;
+      case TRIAL_DONE:
+        m_trial = TRIAL_IDLE;
+        return true;
+      case TRIAL_OPEN_LOOP:
+        report_open_loop();
+        if (phase_done()) {
+          motors.set_motor_volts(0);
+          start_phase(TRIAL_COAST, 200);
+        }
+        break;
+      case TRIAL_COAST:
+        report_open_loop();
+        if (phase_done()) {
+          motors.set_closed_loop(true);
+          m_trial = TRIAL_DONE;
+        }
+        break;
+      case TRIAL_QUEUE:
+        while (m_queue_next < m_queue_count && !profile.queue_full()) {
+          const float *move = m_queue[m_queue_next++];
+          profile.enqueue(move[0], move[1], move[2], m_accel, m_jerk);
+        }
+        if (m_queue_next == m_queue_count) {
+          m_trial = TRIAL_PROFILE;
+        }
+        break;
+      case TRIAL_PROFILE:
+        if (profile.is_finished()) {
+          motors.set_motor_volts(0);
+          motors.disable_controllers();
+          start_phase(TRIAL_SETTLE, 200);
+        }
+        break;
+      case TRIAL_STEP_HOLD:
+        if (phase_done()) {
+          profile.set_position(m_step);
+          start_phase(TRIAL_STEP, 500);
+        }
+        break;
+      case TRIAL_STEP:
+        if (phase_done()) {
+          motors.set_motor_volts(0);
+          start_phase(TRIAL_SETTLE, 100);
+        }
+        break;
+      case TRIAL_SETTLE:
+        if (phase_done()) {
+          disable_drive();
+          reporter.stop_reporting();
+          Serial.println('#');
+          m_trial = TRIAL_DONE;
+        }
+        break;
+    }
+    return false;
+  }
+
+  /***
+   * Stop whatever is running, including a setpoint stream or a capture
+   * dump, and leave the motor off. A capture that is recording keeps
+   * what it has.
+   */
+  void abort_trial() {
+    bool running = trial_running() || setpoints.is_active() || capture.is_dumping();
+    if (trial_running()) {
+      m_trial = TRIAL_DONE;
+    }
+    motors.set_motor_volts(0);
+    motors.set_closed_loop(true);
+    disable_drive();
+    reporter.stop_reporting();
+    capture.stop_dump();
+    if (capture.is_recording()) {
+      capture.disarm();
+    }
+    if (running) {
+      Serial.println(F("# aborted"));
+    }
+  }
+
   void do_open_loop_trial(const Args &args) {
     uint32_t endTime = 2000;
     float volts = 3;
@@ -105,43 +207,15 @@ public:
     Serial.print(volts, 1);
     Serial.println(F(" Volts"));
     Serial.println(F("$time(ms) Volts(V) Speed(deg/s)"));
+    capture.start(); // the rows are not the controller report but an armed capture still records
+    reporter.reset_rows();
     encoders.reset();
     motors.disable_controllers();
     motors.set_closed_loop(false);
     motors.set_motor_volts(volts);
-    uint32_t start_time = millis();
-    uint32_t sample_time = start_time;
-    while (millis() - start_time <= endTime) {
-      uint32_t now = millis();
-      uint32_t elapsed = now - start_time;
-      if (now - sample_time < 5) {
-        continue;
-      }
-      sample_time += 5;
-      Serial.print(elapsed);
-      Serial.print(' ');
-      Serial.print(motors.get_motor_volts(), 1);
-      Serial.print(' ');
-      Serial.print(encoders.robot_speed(), 1);
-      Serial.println();
-    }
-    motors.set_motor_volts(0);
-    endTime += 200;
-    while (millis() - start_time <= endTime) {
-      uint32_t now = millis();
-      uint32_t elapsed = now - start_time;
-      if (now - sample_time < 5) {
-        continue;
-      }
-      sample_time += 5;
-      Serial.print(elapsed);
-      Serial.print(' ');
-      Serial.print(motors.m_motor_volts, 1);
-      Serial.print(' ');
-      Serial.print(encoders.robot_speed(), 1);
-      Serial.println();
-    }
-    motors.set_closed_loop(true);
+    start_phase(TRIAL_OPEN_LOOP, endTime);
+    m_trial_start = m_phase_start;
+    m_sample_time = m_phase_start;
   }
 
   void do_move_trial(const Args &args) {
@@ -150,6 +224,10 @@ public:
     float topSpeed = atof(args.argv[3]);
     float endSpeed = atof(args.argv[4]);
     float accel = atof(args.argv[5]);
+    float jerk = 0; // a jerk limit gives an S-curve profile
+    if (args.argc > 6) {
+      jerk = atof(args.argv[6]);
+    }
     if (dist == 0) {
       dist = 1440;
     }
@@ -176,6 +254,8 @@ public:
     Serial.print(' ');
     Serial.print(accel);
     Serial.print(' ');
+    Serial.print(jerk);
+    Serial.print(' ');
     Serial.println();
     switch (mode) {
       case 0:
@@ -196,44 +276,128 @@ public:
     }
 
     reporter.report_controller_header();
-    profile.start(dist, topSpeed, endSpeed, accel);
-    while (!profile.is_finished()) {
-      reporter.report_controller(profile);
+    profile.start(dist, topSpeed, endSpeed, accel, jerk);
+    m_trial = TRIAL_PROFILE;
+  }
+
+  /***
+   * Run several moves back to back under full control. The arguments are
+   *
+   *    QMOVE accel jerk dist top_speed final_speed [dist top_speed final_speed]...
+   *
+   * Each move is queued as soon as there is room so that it begins
+   * on the tick after the previous one ends. A move that ends with a
+   * non-zero speed runs straight on into the next. The moves are kept
+   * here until then because the command line is gone by the time they
+   * are needed.
+   */
+  void do_queue_trial(const Args &args) {
+    m_accel = 14400;
+    m_jerk = 0;
+    if (args.argc > 1 && atof(args.argv[1]) != 0) {
+      m_accel = atof(args.argv[1]);
     }
-    motors.set_motor_volts(0);
-    motors.disable_controllers();
-    uint32_t end_time = millis();
-    while (millis() - end_time < 200) {
-      reporter.report_controller(profile);
+    if (args.argc > 2) {
+      m_jerk = atof(args.argv[2]);
+    }
+    int segments = (args.argc - 3) / 3;
+    if (segments < 1) {
+      Serial.println(F("QMOVE accel jerk dist speed final [dist speed final]..."));
+      return;
     }
+    for (int i = 0; i < segments; i++) {
+      const int n = 3 + 3 * i;
+      m_queue[i][0] = atof(args.argv[n]);
+      m_queue[i][1] = atof(args.argv[n + 1]);
+      m_queue[i][2] = atof(args.argv[n + 2]);
+    }
+    m_queue_count = segments;
+    m_queue_next = 0;
+    enable_drive();
+    motors.enable_feed_forward();
+    motors.enable_controllers();
+    Serial.print(F("# QMOVE "));
+    Serial.print(segments);
+    Serial.println(F(" segments"));
+    reporter.report_controller_header();
+    m_trial = TRIAL_QUEUE;
+  }
+
+  /***
+   * Follow setpoints streamed from the host under full control. The
+   * stream runs until STREAM OFF, or any other trial, stops it. See
+   * setpoints.h
+   */
+  void start_stream() {
+    enable_drive();
+    motors.enable_feed_forward();
+    motors.enable_controllers();
+    setpoints.start();
+  }
+
+  void stop_stream() {
+    motors.set_motor_volts(0);
     disable_drive();
-    Serial.println('#');
   }
 
   void do_step_trial(const Args &args) {
-    float dist = atof(args.argv[1]);
-    if (dist == 0) {
-      dist = 30;
+    m_step = atof(args.argv[1]);
+    if (m_step == 0) {
+      m_step = 30;
     }
     Serial.println(F("# Controller Only"));
     enable_drive();
     motors.disable_feed_forward();
     motors.enable_controllers();
-    uint32_t start_time = millis();
     reporter.report_controller_header();
-    while (millis() - start_time < 100) {
-      reporter.report_controller(profile);
-    }
-    profile.set_position(dist);
-    while (millis() - start_time < 600) {
-      reporter.report_controller(profile);
-    }
-    motors.set_motor_volts(0);
-    uint32_t end_time = millis();
-    while (millis() - end_time < 100) {
-      reporter.report_controller(profile);
+    start_phase(TRIAL_STEP_HOLD, 100);
+  }
+
+private:
+  enum TrialState : uint8_t {
+    TRIAL_IDLE,
+    TRIAL_DONE,      // finished, not yet reported by update()
+    TRIAL_OPEN_LOOP, // fixed motor voltage
+    TRIAL_COAST,     // open loop, motor off
+    TRIAL_QUEUE,     // moves still waiting to be queued
+    TRIAL_PROFILE,   // until the profile finishes
+    TRIAL_STEP_HOLD, // controller holding before the step
+    TRIAL_STEP,
+    TRIAL_SETTLE, // reporting after the motor is stopped
+  };
+
+  // the longest QMOVE that fits on the command line
+  static const uint8_t QUEUE_TRIAL_MOVES = (MAX_ARGC - 3) / 3;
+
+  void start_phase(TrialState trial, uint32_t duration) {
+    m_trial = trial;
+    m_phase_start = millis();
+    m_phase_duration = duration;
+  }
+
+  bool phase_done() {
+    return millis() - m_phase_start > m_phase_duration;
+  }
+
+  // one row every 5ms, timed from the start of the trial
+  void report_open_loop() {
+    uint32_t now = millis();
+    if (now - m_sample_time < 5) {
+      return;
     }
-    disable_drive();
-    Serial.println('#');
+    m_sample_time += 5;
+    reporter.report_open_loop(now - m_trial_start, motors.get_motor_volts(), encoders.robot_speed());
   }
+
+  TrialState m_trial = TRIAL_IDLE;
+  uint32_t m_phase_start = 0;
+  uint32_t m_phase_duration = 0;
+  uint32_t m_trial_start = 0;
+  uint32_t m_sample_time = 0;
+  float m_step = 0;
+  float m_accel = 0;
+  float m_jerk = 0;
+  float m_queue[QUEUE_TRIAL_MOVES][3];
+  uint8_t m_queue_count = 0;
+  uint8_t m_queue_next = 0;
 };
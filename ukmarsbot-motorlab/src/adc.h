@@ -2,10 +2,46 @@
 #define ADC_H
 
 #include "../config.h"
+#include "current.h"
+#include "fixed.h"
+#include "motors.h"
 #include <Arduino.h>
 #include <util/atomic.h>
 #include <wiring_private.h>
 
+/***
+ * The ADC scanner works through the channels listed in ADC_CHANNELS
+ * once every tick. Systick starts a scan and the ADC interrupt does
+ * the rest, starting each conversion as soon as the last one is done.
+ *
+ * Each channel is converted several times in a row and the results
+ * summed. Dropping ADC_OVERSAMPLE_BITS bits from the sum gives that
+ * many extra bits of resolution, as long as there is a little noise on
+ * the input. That is then smoothed with a simple integer low pass
+ * filter. The filter state is the reading scaled by 2^ADC_FILTER_SHIFT
+ * so no precision is lost in the shift.
+ *
+ * The ADC interrupt only does integer adds and shifts for the scan.
+ * Anything that needs a divide, like the battery compensation, is
+ * worked out by update_battery() which the main loop calls.
+ *
+ * With current sensing, current samples are slotted in between the
+ * scan conversions and the ADC interrupt also runs the current loop.
+ *
+ * A single conversion takes about 26us so the default of 16 samples
+ * for one channel finishes in well under half a tick even at 2kHz.
+ * If a scan has not finished by the next tick, that tick is skipped.
+ */
+
+const uint8_t ADC_CHANNEL_COUNT = sizeof(ADC_CHANNELS) / sizeof(ADC_CHANNELS[0]);
+const uint8_t ADC_OVERSAMPLES = 1 << (2 * ADC_OVERSAMPLE_BITS);
+// the full scale of a filtered reading
+const float ADC_READING_FSR = ADC_FSR * (1 << ADC_OVERSAMPLE_BITS);
+
+static_assert(ADC_CHANNEL_COUNT > 0, "The battery must be the first ADC channel");
+static_assert(ADC_OVERSAMPLE_BITS <= 3, "ADC sample sum would overflow 16 bits");
+static_assert(ADC_OVERSAMPLE_BITS + ADC_FILTER_SHIFT <= 6, "ADC filter state would overflow 16 bits");
+
 class AnalogueConverter {
 
 public:
@@ -31,11 +67,77 @@ public:
     bitSet(ADCSRA, ADPS0);
   }
 
+  // called from systick to begin a new scan of all the channels
   void start_adc_cycle() {
-    bitSet(ADCSRA, ADIE);              // enable the ADC interrupt
-    start_conversion(BATTERY_ADC_PIN); // begin a conversion to get things started
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      if (m_scanning) {
+        return;
+      }
+      m_scanning = true;
+      m_channel = 0;
+      m_sample_count = 0;
+      m_sum = 0;
+      bitSet(ADCSRA, ADIE); // enable the ADC interrupt
+      if (!m_current_sampling) {
+        start_conversion(ADC_CHANNELS[0]);
+      }
+    }
+  }
+
+  /***
+   * Current samples take priority over the scan. If the ADC is busy
+   * with a scan, the current sample is taken as soon as the conversion
+   * in progress is finished and the scan then carries on. Called from
+   * the Timer 2 compare B interrupt. See src/current.h
+   */
+  void request_current_sample() {
+    if (m_scanning || m_current_sampling) {
+      m_current_request = true;
+      return;
+    }
+    start_current_conversion();
   }
 
+  /***
+   * The conversion does not start straight away. It is triggered by the
+   * next Timer 1 overflow, which is in the middle of the PWM pulse.
+   * Clearing the overflow flag arms the trigger.
+   */
+  void start_current_conversion() {
+    m_current_request = false;
+    m_current_sampling = true;
+    ADMUX = (ADC_REF << 6) | (CURRENT_CHANNEL & 0x07);
+    ADCSRB = (ADCSRB & ~(_BV(ADTS2) | _BV(ADTS1) | _BV(ADTS0))) | _BV(ADTS2) | _BV(ADTS1);
+    TIFR1 = _BV(TOV1);
+    bitSet(ADCSRA, ADIE);
+    bitSet(ADCSRA, ADATE);
+  }
+
+  // the next scan conversion unless a current sample is waiting
+  void continue_scan() {
+    if (m_current_request) {
+      start_current_conversion();
+      return;
+    }
+    start_conversion(ADC_CHANNELS[m_channel]);
+  }
+
+#if CURRENT_SENSE
+  void current_sample_done() {
+    bitClear(ADCSRA, ADATE);
+    m_current_sampling = false;
+    current_loop.update(get_adc_result());
+    if (current_loop.is_driving()) {
+      motors.set_motor_volts(current_loop.output_isr());
+    }
+    if (m_scanning) {
+      start_conversion(ADC_CHANNELS[m_channel]);
+    } else {
+      bitClear(ADCSRA, ADIE);
+    }
+  }
+#endif
+
   /***
    * NOTE: Manual analogue conversions
    * ADC channels are automatically converted
@@ -61,30 +163,97 @@ public:
   }
 
   /***
-   * Although only a single channel is used here, the scheme is left
-   * in place for easy expansion. For example, the code could be
-   * used to test and demonstrate a servo or some other system
-   * with analogue feedback
+   * This is the ADC interrupt. It adds up the samples for the current
+   * channel and, when there are enough, filters the decimated sum and
+   * moves on to the next channel. The interrupt is turned off at the
+   * end of the scan.
    */
   void update_channel() {
-    m_battery_adc = get_adc_result();
+#if CURRENT_SENSE
+    if (m_current_sampling) {
+      current_sample_done();
+      return;
+    }
+#endif
+    m_sum += get_adc_result();
+    if (++m_sample_count < ADC_OVERSAMPLES) {
+      continue_scan();
+      return;
+    }
+    uint16_t reading = m_sum >> ADC_OVERSAMPLE_BITS;
+    uint16_t &state = m_filter[m_channel];
+    if (m_filter_ready) {
+      state += reading - (state >> ADC_FILTER_SHIFT);
+    } else {
+      state = reading << ADC_FILTER_SHIFT; // start from the first reading
+    }
+    m_sum = 0;
+    m_sample_count = 0;
+    if (++m_channel < ADC_CHANNEL_COUNT) {
+      continue_scan();
+      return;
+    }
+    m_filter_ready = true;
+    m_scanning = false;
+    if (m_current_request) {
+      start_current_conversion();
+      return;
+    }
     bitClear(ADCSRA, ADIE); // turn off the interrupt
-    m_battery_volts = BATTERY_MULTIPLIER * m_battery_adc;
-    m_battery_compensation = 255.0 / m_battery_volts;
   }
 
-  float get_battery_comp() {
+  /***
+   * The filtered reading for one of the channels in ADC_CHANNELS, by
+   * its index in that list. Full scale is ADC_READING_FSR.
+   */
+  uint16_t get_reading(uint8_t index) {
+    uint16_t state;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      state = m_filter[index];
+    }
+    return state >> ADC_FILTER_SHIFT;
+  }
+
+  /***
+   * Called from the main loop. The battery voltage changes slowly so
+   * there is no need to do the divide any more often. The compensation
+   * is in PWM counts per volt for 8 bit PWM.
+   */
+  void update_battery() {
+    float volts = (BATTERY_MULTIPLIER * ADC_FSR / ADC_READING_FSR) * get_reading(0);
+    real_t comp = 1.0f;
+    if (volts > 1.0f) {
+      comp = 255.0f / volts;
+    }
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      m_battery_volts = volts;
+      m_battery_compensation = comp;
+    }
+  }
+
+  real_t get_battery_comp() {
     return m_battery_compensation;
   };
 
   float get_battery_voltage() {
-    return m_battery_volts;
+    float volts;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      volts = m_battery_volts;
+    }
+    return volts;
   }
 
 private:
-  volatile int m_battery_adc;
-  volatile float m_battery_volts;
-  volatile float m_battery_compensation;
+  volatile bool m_scanning = false;
+  volatile bool m_current_sampling = false;
+  volatile bool m_current_request = false;
+  bool m_filter_ready = false;
+  uint8_t m_channel = 0;
+  uint8_t m_sample_count = 0;
+  uint16_t m_sum = 0;
+  uint16_t m_filter[ADC_CHANNEL_COUNT];
+  float m_battery_volts = 0;
+  real_t m_battery_compensation = 1.0f;
 };
 
 extern AnalogueConverter adc;
@@ -0,0 +1,441 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include "../config.h"
+#include "fixed.h"
+#include "profile.h"
+#include "snapshot.h"
+#include "telemetry.h"
+#include "utils.h"
+#include <Arduino.h>
+#include <util/atomic.h>
+
+/***
+ * Records a trial in RAM so that it can be sent afterwards at whatever
+ * speed the serial link can manage. Nothing is lost and every sample
+ * is exactly 'divisor' ticks after the last.
+ *
+ * The CAPTURE command chooses the channels and the sample rate and
+ * arms the capture. The next trial to start sends its report header
+ * and that starts the capture. Systick then stores one sample every
+ * divisor ticks, taken from the control snapshot, until the buffer is
+ * full. The DUMP command prints the samples as a text table.
+ *
+ * Triggered capture
+ * -----------------
+ * The TRIG command works like the trigger on a scope. Recording starts
+ * straight away and goes round the buffer continuously, keeping the
+ * most recent history, while each tick is checked against the trigger
+ * condition. When the condition is met, recording carries on until the
+ * requested share of the buffer holds samples from after the trigger
+ * and then stops. Nothing is sent until then so the serial port is
+ * quiet however long it takes for the trigger to happen.
+ *
+ * The condition is on the value of one channel, or on the profile
+ * state, and it fires on the change: when the value goes above the
+ * level, goes below it, goes outside +/- level or becomes equal to it.
+ * A condition that is already met when the trigger is armed has to
+ * go away and come back again.
+ *
+ * The samples stay on the divisor grid when the trigger fires so they
+ * are all evenly spaced. The first sample after the trigger may then
+ * come up to divisor - 1 ticks after it. That lag is kept and DUMP
+ * adds it to the times so that the trigger is always at time 0.
+ *
+ * Storage
+ * -------
+ * Each channel is stored as an int16 with the same scaling as the
+ * binary telemetry, except for positions which are in 1/4 count so
+ * that they cover +/- 24000 degrees. Values that do not fit are clipped.
+ *
+ * The buffer is only CAPTURE_BUFFER_BYTES long. It holds
+ * CAPTURE_BUFFER_BYTES / (2 * channels) samples, so a long trial needs
+ * fewer channels or a larger divisor. With the default 384 bytes that
+ * is 27 samples of the 7 default channels or 192 of just one.
+ */
+
+enum CaptureChannel : uint8_t {
+  CAP_SET_POS = 0,
+  CAP_ROBOT_POS,
+  CAP_ERROR,
+  CAP_SET_SPEED,
+  CAP_ROBOT_SPEED,
+  CAP_CTRL_VOLTS,
+  CAP_FF_VOLTS,
+  CAP_MOTOR_VOLTS,
+  CAP_CHANNEL_COUNT,
+};
+
+// a trigger source but not a channel that can be recorded
+const uint8_t TRIG_PROFILE_STATE = CAP_CHANNEL_COUNT;
+
+// channel names, and the profile state, padded to a fixed width of 12 characters
+const uint8_t CAPTURE_NAME_WIDTH = 12;
+const char CAPTURE_NAMES[] PROGMEM = "set_pos     robot_pos   error       set_speed   robot_speed ctrl_volts  ff_volts    motor_volts state       ";
+
+enum TriggerCondition : uint8_t {
+  TRIG_ABOVE = 0,
+  TRIG_BELOW,
+  TRIG_OUTSIDE,
+  TRIG_EQUAL,
+  TRIG_CONDITION_COUNT,
+};
+
+const uint8_t TRIGGER_NAME_WIDTH = 8;
+const char TRIGGER_NAMES[] PROGMEM = "above   below   outside equal   ";
+
+// the default is the same columns as the controller report, without the error
+const uint8_t CAPTURE_DEFAULT_CHANNELS = 0xFB;
+
+enum CaptureState : uint8_t {
+  CAPTURE_IDLE = 0,
+  CAPTURE_ARMED = 1,
+  CAPTURE_RUNNING = 2,
+  CAPTURE_DONE = 3,
+  CAPTURE_WAITING = 4, // recording and waiting for the trigger
+};
+
+constexpr uint8_t bit_count(uint8_t bits) {
+  return bits ? (bits & 1) + bit_count(bits >> 1) : 0;
+}
+
+/***
+ * Find a name in one of the fixed width tables above. The match ignores
+ * case since the CLI converts everything to upper case. Returns -1 if
+ * the name is not there.
+ */
+inline int8_t find_name(const char *name, const char *table, uint8_t width, uint8_t count) {
+  for (uint8_t i = 0; i < count; i++) {
+    const char *entry = table + i * width;
+    uint8_t n = 0;
+    while (n < width && name[n] && tolower(name[n]) == pgm_read_byte(entry + n)) {
+      n++;
+    }
+    if (name[n] == 0 && (n == width || pgm_read_byte(entry + n) == ' ')) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// print a name from one of the tables without the padding
+inline void print_name(const char *table, uint8_t width, uint8_t index) {
+  const char *entry = table + index * width;
+  for (uint8_t n = 0; n < width; n++) {
+    char c = pgm_read_byte(entry + n);
+    if (c == ' ') {
+      break;
+    }
+    Serial.write(c);
+  }
+}
+
+class Capture;
+extern Capture capture;
+
+class Capture {
+public:
+  /***
+   * Choose the channels to record, given by the bits in mask, and record
+   * one sample every divisor ticks. Returns false if no channels are
+   * selected. Any capture in progress is stopped and anything already
+   * recorded is lost.
+   */
+  bool set_channels(uint8_t mask, uint8_t divisor) {
+    uint8_t channels = bit_count(mask);
+    if (channels == 0 || divisor == 0) {
+      return false;
+    }
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      m_state = CAPTURE_IDLE;
+      m_mask = mask;
+      m_channels = channels;
+      m_divisor = divisor;
+      m_capacity = (CAPTURE_BUFFER_BYTES / 2) / channels;
+      m_samples = 0;
+    }
+    return true;
+  }
+
+  // record from the start of the next trial
+  void arm() {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      m_samples = 0;
+      m_state = CAPTURE_ARMED;
+    }
+  }
+
+  /***
+   * Start recording now and stop once the trigger has fired and
+   * (100 - pre_percent)% of the buffer has been filled after it. The
+   * level is in degrees, deg/s or Volts, as printed by DUMP, or it is a
+   * profile state.
+   */
+  void arm_trigger(uint8_t source, uint8_t condition, float level, uint8_t pre_percent) {
+    if (source != TRIG_PROFILE_STATE) {
+      level = level / scale(source);
+    }
+    int16_t raw = lround(constrain(level, -32767.0f, 32767.0f));
+    uint16_t pre = (uint32_t)m_capacity * min(pre_percent, 100) / 100;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      m_trigger_source = source;
+      m_trigger_condition = condition;
+      m_trigger_level = raw;
+      m_pre_percent = pre_percent;
+      m_pre = min(pre, m_capacity - 1);
+      m_trigger_met = true; // so that it has to change first
+      m_trigger_lag = 0;
+      m_countdown = 1;
+      m_next = 0;
+      m_samples = 0;
+      m_state = CAPTURE_WAITING;
+    }
+  }
+
+  // stop recording. What has been recorded so far can still be dumped.
+  void disarm() {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      m_state = m_samples ? CAPTURE_DONE : CAPTURE_IDLE;
+    }
+  }
+
+  // called at the start of a trial. Does nothing unless armed.
+  void start() {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      if (m_state == CAPTURE_ARMED) {
+        m_countdown = 1;
+        m_next = 0;
+        m_trigger_offset = 0;
+        m_trigger_lag = 0;
+        m_remaining = m_capacity;
+        m_state = CAPTURE_RUNNING;
+      }
+    }
+  }
+
+  uint8_t state() { return m_state; }
+  bool is_recording() { return m_state == CAPTURE_RUNNING || m_state == CAPTURE_WAITING; }
+  uint8_t mask() { return m_mask; }
+  uint8_t divisor() { return m_divisor; }
+  uint16_t capacity() { return m_capacity; }
+  uint16_t trigger_offset() { return m_trigger_offset; }
+  uint8_t trigger_lag() { return m_trigger_lag; }
+
+  uint16_t samples() {
+    uint16_t n;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      n = m_samples;
+    }
+    return n;
+  }
+
+  // as given to TRIG, for the reply
+  void print_trigger() {
+    print_name(CAPTURE_NAMES, CAPTURE_NAME_WIDTH, m_trigger_source);
+    Serial.write(' ');
+    print_name(TRIGGER_NAMES, TRIGGER_NAME_WIDTH, m_trigger_condition);
+    Serial.write(' ');
+    if (m_trigger_source == TRIG_PROFILE_STATE) {
+      Serial.print(m_trigger_level);
+    } else {
+      Serial.print(m_trigger_level * scale(m_trigger_source), 3);
+    }
+    Serial.write(' ');
+    Serial.print(m_pre_percent);
+  }
+
+  // from systick, after the snapshot has been published
+  void update() {
+    if (m_state == CAPTURE_WAITING) {
+      if (triggered()) {
+        // the next sample on the grid is the first after the trigger
+        m_trigger_offset = min(m_samples, m_pre);
+        m_trigger_lag = m_countdown - 1;
+        m_remaining = m_capacity - m_pre;
+        m_state = CAPTURE_RUNNING;
+      }
+    } else if (m_state != CAPTURE_RUNNING) {
+      return;
+    }
+    if (--m_countdown) {
+      return;
+    }
+    m_countdown = m_divisor;
+    store(snapshot.state_isr());
+    if (m_samples < m_capacity) {
+      m_samples++;
+    }
+    if (m_state == CAPTURE_RUNNING && --m_remaining == 0) {
+      m_state = CAPTURE_DONE;
+    }
+  }
+
+  /***
+   * Print the samples as a table with a header. Times are in ticks from
+   * the start of the capture, or from the trigger, so samples before
+   * the trigger have negative times. They are exact, even for a
+   * trigger that fell between samples. Positions are in degrees, speeds
+   * in deg/s and voltages in Volts. Do not use this while recording.
+   *
+   * The table goes out a row at a time from the main loop so that it
+   * never holds anything else up. start_dump() prints the header and
+   * each call to dump_rows() then sends the next row, but only once the
+   * serial transmit buffer is empty. dump_rows() returns true once,
+   * after the last row. stop_dump() cuts the table short.
+   */
+  void start_dump() {
+    Serial.print(F("$tick"));
+    for (uint8_t ch = 0; ch < CAP_CHANNEL_COUNT; ch++) {
+      if (m_mask & (1 << ch)) {
+        Serial.write(' ');
+        print_name(CAPTURE_NAMES, CAPTURE_NAME_WIDTH, ch);
+      }
+    }
+    Serial.println();
+    m_dump_row = 0;
+    m_dumping = true;
+  }
+
+  bool is_dumping() { return m_dumping; }
+
+  void stop_dump() {
+    m_dump_row = samples();
+  }
+
+  bool dump_rows() {
+    if (!m_dumping) {
+      return false;
+    }
+    if (m_dump_row >= samples()) {
+      m_dumping = false;
+      return true;
+    }
+    if (Serial.availableForWrite() < SERIAL_TX_BUFFER_SIZE - 1) {
+      return false;
+    }
+    uint16_t i = m_dump_row++;
+    uint16_t sample = (m_next + m_capacity - samples() + i) % m_capacity;
+    Serial.print(((int32_t)i - m_trigger_offset) * m_divisor + m_trigger_lag);
+    const int16_t *data = m_buffer + sample * m_channels;
+    for (uint8_t ch = 0; ch < CAP_CHANNEL_COUNT; ch++) {
+      if (m_mask & (1 << ch)) {
+        Serial.write(' ');
+        Serial.print(*data++ * scale(ch), ch >= CAP_CTRL_VOLTS ? 3 : 2);
+      }
+    }
+    Serial.println();
+    return false;
+  }
+
+  /***
+   * For binary readout. The n'th value stored, counting from the first
+   * channel of the oldest sample. Do not use this while recording.
+   */
+  int16_t value_at(uint16_t n) {
+    uint16_t oldest = (m_next + m_capacity - m_samples) % m_capacity;
+    uint16_t sample = (oldest + n / m_channels) % m_capacity;
+    return m_buffer[sample * m_channels + n % m_channels];
+  }
+
+private:
+  // the samples go round the buffer, oldest first
+  void store(const ControlState &state) {
+    int16_t *data = m_buffer + m_next * m_channels;
+    for (uint8_t ch = 0; ch < CAP_CHANNEL_COUNT; ch++) {
+      if (m_mask & (1 << ch)) {
+        *data++ = value(state, ch);
+      }
+    }
+    if (++m_next >= m_capacity) {
+      m_next = 0;
+    }
+  }
+
+  // true only on the tick when the condition becomes met
+  bool triggered() {
+    int16_t v;
+    if (m_trigger_source == TRIG_PROFILE_STATE) {
+      v = profile.state();
+    } else {
+      v = value(snapshot.state_isr(), m_trigger_source);
+    }
+    bool met;
+    switch (m_trigger_condition) {
+      case TRIG_ABOVE:
+        met = v > m_trigger_level;
+        break;
+      case TRIG_BELOW:
+        met = v < m_trigger_level;
+        break;
+      case TRIG_OUTSIDE:
+        met = v > m_trigger_level || v < -m_trigger_level;
+        break;
+      default:
+        met = v == m_trigger_level;
+        break;
+    }
+    bool fired = met && !m_trigger_met;
+    m_trigger_met = met;
+    return fired;
+  }
+
+  static int16_t value(const ControlState &state, uint8_t ch) {
+    switch (ch) {
+      case CAP_SET_POS:
+        return scaled_int16(state.set_position - Position(), 4);
+      case CAP_ROBOT_POS:
+        return scaled_int16(state.robot_position - Position(), 4);
+      case CAP_ERROR:
+        return scaled_int16(state.set_position - state.robot_position, 64);
+      case CAP_SET_SPEED:
+        return scaled_int16(state.set_speed, SPEED_SCALE);
+      case CAP_ROBOT_SPEED:
+        return scaled_int16(state.robot_speed, SPEED_SCALE);
+      case CAP_CTRL_VOLTS:
+        return scaled_int16(state.ctrl_volts, 1000);
+      case CAP_FF_VOLTS:
+        return scaled_int16(state.ff_volts, 1000);
+      case CAP_MOTOR_VOLTS:
+        return scaled_int16(state.motor_volts, 1000);
+    }
+    return 0;
+  }
+
+  // to convert a stored value back to degrees, deg/s or Volts
+  static float scale(uint8_t ch) {
+    switch (ch) {
+      case CAP_SET_POS:
+      case CAP_ROBOT_POS:
+        return DEG_PER_COUNT / 4;
+      case CAP_ERROR:
+        return DEG_PER_COUNT / 64;
+      case CAP_SET_SPEED:
+      case CAP_ROBOT_SPEED:
+        return DEG_PER_COUNT / SPEED_SCALE;
+    }
+    return 0.001f;
+  }
+
+  int16_t m_buffer[CAPTURE_BUFFER_BYTES / 2];
+  volatile uint8_t m_state = CAPTURE_IDLE;
+  uint8_t m_mask = CAPTURE_DEFAULT_CHANNELS;
+  uint8_t m_channels = bit_count(CAPTURE_DEFAULT_CHANNELS);
+  uint8_t m_divisor = 1;
+  uint8_t m_countdown = 1;
+  uint16_t m_capacity = (CAPTURE_BUFFER_BYTES / 2) / bit_count(CAPTURE_DEFAULT_CHANNELS);
+  uint16_t m_next = 0;     // where the next sample goes
+  uint16_t m_samples = 0;  // how many are in the buffer
+  uint16_t m_remaining = 0; // still to record after the trigger
+  uint16_t m_pre = 0;       // samples to keep from before the trigger
+  uint16_t m_trigger_offset = 0;
+  uint8_t m_trigger_lag = 0; // ticks from the trigger to the next sample
+  uint8_t m_trigger_source = CAP_ERROR;
+  uint8_t m_trigger_condition = TRIG_OUTSIDE;
+  uint8_t m_pre_percent = 50;
+  int16_t m_trigger_level = 0;
+  bool m_trigger_met = true;
+  uint16_t m_dump_row = 0;
+  bool m_dumping = false;
+};
+
+#endif
@@ -37,8 +37,25 @@
 #include <Arduino.h>
 #include <stdint.h>
 
-const int INPUT_BUFFER_SIZE = 32;
-const int MAX_CMD_COUNT = 24;
+const int INPUT_BUFFER_SIZE = 64;
+const uint8_t CLI_NAME_LENGTH = 8;
+const uint8_t CLI_HELP_LENGTH = 36;
+
+/***
+ * The commands are a table in flash, handed over with set_commands().
+ * As in the parameter table, each row holds a hash of the name so a
+ * lookup compares one 16 bit word per row and only checks the name of
+ * the row that matches. See name_hash() in utils.h
+ */
+struct CliCommand {
+  uint16_t hash;
+  char name[CLI_NAME_LENGTH];
+  char help[CLI_HELP_LENGTH];
+  cmd_func_ptr_t func;
+};
+
+#define CLI_COMMAND(name, func, help) \
+  { name_hash(name), name, help, func }
 
 class CommandLineInterface {
 
@@ -58,16 +75,22 @@ public:
    * echoed but not placed in the buffer.
    *
    * All printable characters are placed in a buffer with a
-   * maximum length of just 32 characters. You could make this
-   * longer but there should be little practical need.
+   * maximum length of 64 characters. That is enough for several
+   * parameters to be set on one line.
    *
    * All other characters, including carriage returns are ignored.
    *
+   * A zero byte can never be part of a text line. It marks the start
+   * of a binary frame, which is collected into the same buffer, as it
+   * is, until the next zero. Then the frame is complete and 1 is
+   * returned just as for a text line. See protocol.h
+   *
    */
   const char BACKSPACE = 0x08;
 
+  // nothing is echoed while a command is running. See command_finished()
   void echo(char c) {
-    if (m_echo) {
+    if (m_echo && !m_running) {
       Serial.print(c);
     }
   }
@@ -75,7 +98,17 @@ public:
   int read_serial() {
     while (Serial.available()) {
       char c = Serial.read();
-      if (c == '\n') {
+      if (c == 0) {
+        if (m_binary && m_index > 0) {
+          return 1;
+        }
+        m_binary = true;
+        m_index = 0;
+      } else if (m_binary) {
+        if (m_index < INPUT_BUFFER_SIZE) {
+          m_input_buffer[m_index++] = c;
+        }
+      } else if (c == '\n') {
         echo(c);
         return 1;
       } else if (c == BACKSPACE) {
@@ -117,8 +150,11 @@ public:
    *
    * Once a command line has been dealt with, the input buffer is
    * cleared, that means that new characters that arrive while a
-   * function is executing will be lost. A side effect of that
-   * is that commands cannot be aborted over the serial link.
+   * function is executing will be lost. None of the commands take
+   * long. The trials return as soon as they have started and run
+   * from loop() so other commands, ABORT among them, can be typed
+   * while they run. A command that returns CLI_RUNNING has started
+   * something of that kind. See command_finished().
    *
    * NOTES:
    *    - serial input is dealt with by polling so you must
@@ -128,10 +164,40 @@ public:
    *
    */
   void interpret_line() {
+    if (m_binary) {
+      m_binary = false;
+      if (m_frame_action && m_frame_action((uint8_t *)m_input_buffer, m_index) == CLI_RUNNING) {
+        m_running = true;
+      }
+      clear_input();
+      return;
+    }
     Args args = get_tokens();
-    execute(args);
+    if (execute(args) == CLI_RUNNING) {
+      m_running = true;
+      m_prompt_when_finished = true;
+    }
     clear_input();
-    prompt();
+    if (!m_running) {
+      prompt();
+    }
+  }
+
+  /***
+   * Call this when whatever a command started has finished. Until then
+   * other commands can be used but get no echo and no prompt, so that
+   * nothing gets in the way of the lines the running command sends.
+   *
+   * Only a text command gets a prompt when it finishes. A binary frame
+   * has had its reply already and a prompt would land in the middle of
+   * the host's binary stream.
+   */
+  void command_finished() {
+    m_running = false;
+    if (m_prompt_when_finished) {
+      m_prompt_when_finished = false;
+      prompt();
+    }
   }
 
   /***
@@ -158,15 +224,19 @@ public:
    */
   Args get_tokens() {
     Args args = {0};
-    char *line = m_input_buffer;
+    tokenize(m_input_buffer, args);
+    return args;
+  }
+
+  // add the tokens in line to those already in args
+  static void tokenize(char *line, Args &args) {
     char *token;
     for (token = strtok(line, " ,="); token != NULL; token = strtok(NULL, " ,=")) {
-      args.argv[args.argc] = token;
-      args.argc++;
       if (args.argc == MAX_ARGC)
         break;
+      args.argv[args.argc] = token;
+      args.argc++;
     }
-    return args;
   }
 
   /***
@@ -175,25 +245,36 @@ public:
    *
    * The arguments will be passed on to the robot.
    */
-  void execute(const Args &args) {
+  cli_status_t execute(const Args &args) {
+    if (args.argc == 0) {
+      return CLI_OK;
+    }
     // 'internal' cli commands
     if (strcmp_P(args.argv[0], PSTR("ECHO")) == 0) {
       if (strcmp_P(args.argv[1], PSTR("ON")) == 0) {
         enable_echo();
-        return;
+        return CLI_OK;
       } else {
         disable_echo();
-        return;
+        return CLI_OK;
       };
     } else if (strcmp_P(args.argv[0], PSTR("?")) == 0) {
       help();
-      return;
+      return CLI_OK;
     }
     // 'public' commands
-    for (int i = 0; i < m_last_command; i++) {
-      if (strcmp_P(args.argv[0], m_commands[i]) == 0) {
-        m_actions[i](args);
-        return;
+    uint16_t hash = hash_name(args.argv[0]);
+    for (uint8_t i = 0; i < m_command_count; i++) {
+      const CliCommand &command = m_commands[i];
+      if (pgm_read_word(&command.hash) == hash && strcmp_P(args.argv[0], command.name) == 0) {
+        cmd_func_ptr_t func = (cmd_func_ptr_t)pgm_read_ptr(&command.func);
+        return func(args);
+      }
+    }
+    if (m_default_action) {
+      cli_status_t status = m_default_action(args);
+      if (status != CLI_E_CMD_NOT_FOUND) {
+        return status;
       }
     }
     Serial.print('"');
@@ -201,6 +282,7 @@ public:
     Serial.print('"');
     Serial.print(' ');
     Serial.print(F("Unknown Command\n"));
+    return CLI_E_CMD_NOT_FOUND;
   }
 
   void clear_input() {
@@ -209,15 +291,15 @@ public:
   }
 
   void help() {
-    Serial.print(m_last_command);
+    Serial.print(m_command_count);
     Serial.println(F(" commands"));
-    for (int i = 0; i < m_last_command; i++) {
-      int n = Serial.print((__FlashStringHelper *)m_commands[i]);
+    for (uint8_t i = 0; i < m_command_count; i++) {
+      int n = Serial.print((const __FlashStringHelper *)m_commands[i].name);
       n = 10 - n;
       while (n--) {
         Serial.write(' ');
       }
-      Serial.print((__FlashStringHelper *)m_help_texts[i]);
+      Serial.print((const __FlashStringHelper *)m_commands[i].help);
       Serial.println();
     }
   }
@@ -235,23 +317,34 @@ public:
     m_echo = false;
   }
 
-  void add_cmd(cmd_func_ptr_t func, const char *cmd, const char *help) {
-    if (m_last_command >= MAX_CMD_COUNT) {
-      Serial.println(F("Too many Commands"));
-      return; // drop the method
-    }
-    m_commands[m_last_command] = cmd;
-    m_actions[m_last_command] = func;
-    m_help_texts[m_last_command] = help;
-    m_last_command++;
+  /***
+   * Anything that is not a command is offered to this function. It
+   * should return CLI_E_CMD_NOT_FOUND if it does not recognise it.
+   */
+  void set_default_action(cmd_func_ptr_t func) {
+    m_default_action = func;
+  }
+
+  // complete binary frames are passed to this function
+  void set_frame_action(frame_func_ptr_t func) {
+    m_frame_action = func;
+  }
+
+  // the table must be in PROGMEM
+  void set_commands(const CliCommand *commands, uint8_t count) {
+    m_commands = commands;
+    m_command_count = count;
   }
 
 private:
   char m_input_buffer[INPUT_BUFFER_SIZE];
   uint8_t m_index = 0;
   bool m_echo = true;
-  int m_last_command = 0;
-  const char *m_commands[MAX_CMD_COUNT] = {};
-  const char *m_help_texts[MAX_CMD_COUNT] = {};
-  cmd_func_ptr_t m_actions[MAX_CMD_COUNT] = {};
+  const CliCommand *m_commands = nullptr;
+  uint8_t m_command_count = 0;
+  cmd_func_ptr_t m_default_action = nullptr;
+  frame_func_ptr_t m_frame_action = nullptr;
+  bool m_binary = false;
+  bool m_running = false;
+  bool m_prompt_when_finished = false;
 };
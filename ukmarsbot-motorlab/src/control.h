@@ -0,0 +1,108 @@
+#ifndef CONTROL_H
+#define CONTROL_H
+
+#include "fixed.h"
+
+/***
+ * The arithmetic of the position controller and the feedforward,
+ * written once for any pair of number formats. Motors uses it with
+ * real_t and coeff_t. test/test_fixed builds the same code with float
+ * and with the fixed point types and compares the two.
+ *
+ * The settings are per degree but the control path works in encoder
+ * counts so the gains are scaled by the degrees per count when they
+ * are loaded. Kd and accFF are also multiplied by the loop frequency
+ * because the difference and the acceleration are per tick.
+ *
+ * Saturation
+ * ----------
+ * A real_t only goes up to 32767. Within the parameter limits a
+ * product such as error * kp can go past that and wrap round, which
+ * would flip the sign of the motor voltage where float just gets very
+ * large. So each input is clamped to the value that keeps its term
+ * within MAX_TERM_VOLTS. That is far beyond any motor voltage, so the
+ * output still saturates in set_motor_volts() just as it does in
+ * float, and the sum of all the terms cannot overflow either.
+ */
+const float MAX_TERM_VOLTS = 8000.0f;
+
+template <typename T>
+inline T clamp_to(T value, T limit) {
+  if (value > limit) {
+    return limit;
+  }
+  if (value < -limit) {
+    return -limit;
+  }
+  return value;
+}
+
+// the largest input that keeps input * gain within MAX_TERM_VOLTS
+inline float input_limit(float gain) {
+  gain = fabsf(gain);
+  if (gain * 32767.0f > MAX_TERM_VOLTS) {
+    return MAX_TERM_VOLTS / gain;
+  }
+  return 32767.0f;
+}
+
+template <typename R, typename C>
+class ControlGains {
+public:
+  // this has divides in it so call it from the main loop only
+  void load(float kp, float kd, float speed_ff, float acc_ff, float bias_ff, float deg_per_count, float frequency) {
+    kp *= deg_per_count;
+    kd *= deg_per_count * frequency;
+    speed_ff *= deg_per_count;
+    acc_ff *= deg_per_count * frequency;
+    m_kp = kp;
+    m_kd = kd;
+    m_speed_ff = speed_ff;
+    m_acc_ff = acc_ff;
+    m_bias_ff = bias_ff;
+    m_error_limit = input_limit(kp);
+    m_diff_limit = input_limit(kd);
+    m_speed_limit = input_limit(speed_ff);
+    m_acc_limit = input_limit(acc_ff);
+  }
+
+  // error and diff are in counts, the result in Volts
+  R position_output(R error, R diff) const {
+    return clamp_to(error, m_error_limit) * m_kp + clamp_to(diff, m_diff_limit) * m_kd;
+  }
+
+  // the voltage needed to overcome the back EMF at a given speed
+  R speed_output(R speed) const {
+    return clamp_to(speed, m_speed_limit) * m_speed_ff;
+  }
+
+  /***
+   * Speed is in counts per second and acceleration is the change in
+   * speed over the last tick. The bias is added once the speed is past
+   * the threshold, in the direction of motion.
+   */
+  R feed_forward(R speed, R acceleration, R bias_threshold) const {
+    R output = speed_output(speed) + clamp_to(acceleration, m_acc_limit) * m_acc_ff;
+    if (speed > bias_threshold) {
+      output += m_bias_ff;
+    }
+    if (speed < -bias_threshold) {
+      output -= m_bias_ff;
+    }
+    return output;
+  }
+
+private:
+  C m_kp;
+  R m_kd;
+  C m_speed_ff;
+  R m_acc_ff;
+  R m_bias_ff;
+  // inputs past these would overflow their term. See above
+  R m_error_limit;
+  R m_diff_limit;
+  R m_speed_limit;
+  R m_acc_limit;
+};
+
+#endif
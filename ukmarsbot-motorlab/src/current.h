@@ -0,0 +1,167 @@
+#ifndef CURRENT_H
+#define CURRENT_H
+
+#include "../config.h"
+#include "fixed.h"
+#include "looptime.h"
+#include <Arduino.h>
+#include <util/atomic.h>
+
+/***
+ * An inner current loop for drivers with a current sense output. It
+ * is only used if CURRENT_SENSE is set in config.h
+ *
+ * Motor torque is proportional to current. With the current under
+ * closed loop control, the position controller no longer has to wait
+ * for the winding to respond to a change in voltage, and disturbances
+ * that change the load are corrected by the inner loop before they
+ * show up as a position error.
+ *
+ * Timing
+ * ------
+ * Timer 2 compare B interrupts CURRENT_LOOP_RATIO times each tick, at
+ * evenly spaced points that avoid the start of the tick where systick
+ * runs. Each one asks the ADC for a current sample. The conversion is
+ * triggered by the next Timer 1 overflow. In phase correct PWM mode
+ * that happens at BOTTOM, which is the middle of the PWM pulse, so the
+ * sample misses the switching noise at the edges. See src/adc.h
+ *
+ * The ADC interrupt then calls update() with the reading and, if the
+ * loop is driving the motor, applies the new output voltage.
+ *
+ * The loop
+ * --------
+ * When the loop is enabled, Motors::update_controllers() turns its
+ * output into a current demand by dividing by the winding resistance.
+ * The back EMF is left out of that and passed on separately, worked out
+ * from the measured speed. The output voltage is then
+ *
+ *    V = R * demand + back_emf + Kp * error + Ki * integral(error)
+ *
+ * The first two terms are what an ideal motor would need. The PI terms
+ * correct for everything else. With the current loop off, the current
+ * is still measured so that it can be reported.
+ */
+
+const real_t CURRENT_MAX_VOLTS = MAX_MOTOR_VOLTS;
+
+class CurrentLoop;
+extern CurrentLoop current_loop;
+
+class CurrentLoop {
+public:
+  void begin() {
+    load_coefficients();
+    m_step = 0;
+    OCR2B = compare_point(0);
+    bitSet(TIMSK2, OCIE2B);
+  }
+
+  // call whenever the loop frequency changes
+  void load_coefficients() {
+    float rate = float(loop_time.frequency()) * CURRENT_LOOP_RATIO;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      m_amps_per_count = ADC_REF_VOLTS / ADC_FSR / CURRENT_SENSE_VOLTS_PER_AMP;
+      m_resistance = MOTOR_RESISTANCE;
+      m_kp = CURRENT_KP;
+      m_ki = CURRENT_KI / rate;
+    }
+  }
+
+  // the Timer 2 counts at which to sample the current
+  static uint8_t compare_point(uint8_t step) {
+    return ((2 * step + 1) * TIMER2_COUNTS_PER_TICK) / (2 * CURRENT_LOOP_RATIO);
+  }
+
+  // from the Timer 2 compare B interrupt. Sets up the next one.
+  void next_sample_point() {
+    if (++m_step >= CURRENT_LOOP_RATIO) {
+      m_step = 0;
+    }
+    OCR2B = compare_point(m_step);
+  }
+
+  void enable() {
+    m_enabled = true;
+  }
+
+  void disable() {
+    m_enabled = false;
+    m_driving = false;
+  }
+
+  bool is_enabled() { return m_enabled; }
+
+  // is the loop setting the motor voltage?
+  bool is_driving() { return m_driving; }
+
+  /***
+   * Called from systick with the demand in Amps and the back EMF in
+   * Volts. The ADC interrupt can break into systick so both are set
+   * together.
+   */
+  void set_demand(real_t amps, real_t back_emf) {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      m_demand = amps;
+      m_back_emf = back_emf;
+      m_driving = true;
+    }
+  }
+
+  // hand the motor back to the voltage controller
+  void release() {
+    m_driving = false;
+  }
+
+  /***
+   * From the ADC interrupt with the raw reading. Works out the current
+   * and, if the loop is driving the motor, the new output voltage.
+   */
+  void update(int reading) {
+    m_current = real_t(reading - CURRENT_ZERO_COUNTS) * m_amps_per_count;
+    if (!m_driving) {
+      m_integral = 0;
+      return;
+    }
+    real_t error = m_demand - m_current;
+    m_integral += error * m_ki;
+    m_integral = constrain(m_integral, -CURRENT_MAX_VOLTS, CURRENT_MAX_VOLTS);
+    m_volts = m_demand * m_resistance + m_back_emf + error * m_kp + m_integral;
+  }
+
+  real_t output_isr() { return m_volts; }
+
+  // in Amps
+  float current() {
+    real_t amps;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      amps = m_current;
+    }
+    return float(amps);
+  }
+
+  float demand() {
+    real_t amps;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      amps = m_demand;
+    }
+    return float(amps);
+  }
+
+private:
+  volatile bool m_enabled = false;
+  volatile bool m_driving = false;
+  uint8_t m_step = 0;
+  real_t m_current = 0;
+  real_t m_demand = 0;
+  real_t m_back_emf = 0;
+  real_t m_integral = 0;
+  real_t m_volts = 0;
+  // working copies of the configuration. See load_coefficients()
+  coeff_t m_amps_per_count;
+  real_t m_resistance;
+  real_t m_kp;
+  coeff_t m_ki; // per sample
+};
+
+#endif
@@ -76,6 +76,10 @@
 
 */
 #include "../config.h"
+#include "fixed.h"
+#include "looptime.h"
+#include "position.h"
+#include "settings.h"
 #include <Arduino.h>
 #include <stdint.h>
 #include <util/atomic.h>
@@ -90,6 +94,75 @@
  */
 const int AVERAGER_LENGTH = 8;
 
+// converts the averager total into counts moved in one tick
+const coeff_t AVERAGER_SCALE = 1.0f / AVERAGER_LENGTH;
+
+/***
+ * The encoder ISR reads both encoder pins with a single read of PIND
+ * so they must both be on port D. That is Arduino pins 0 to 7.
+ */
+static_assert(ENCODER_CLK < 8 && ENCODER_DIR < 8, "Encoder pins must be on port D");
+const uint8_t ENCODER_CLK_MASK = 1 << ENCODER_CLK;
+const uint8_t ENCODER_DIR_MASK = 1 << ENCODER_DIR;
+
+/***
+ * Quadrature state transition table.
+ *
+ * The state is two bits, (A << 1) | B, and the table is indexed by
+ * (old_state << 2) | new_state. Each entry is the change in count,
+ * with the encoder polarity already applied.
+ *
+ * A change in both A and B at once is not possible with a working
+ * encoder. It means an edge has been missed and is counted as an error.
+ */
+const int8_t QUAD_ERROR = 2;
+const int8_t QUAD_TABLE[16] PROGMEM = {
+  0, ENCODER_POLARITY, -ENCODER_POLARITY, QUAD_ERROR,  //
+  -ENCODER_POLARITY, 0, QUAD_ERROR, ENCODER_POLARITY,  //
+  ENCODER_POLARITY, QUAD_ERROR, 0, -ENCODER_POLARITY,  //
+  QUAD_ERROR, -ENCODER_POLARITY, ENCODER_POLARITY, 0,  //
+};
+
+/***
+ * Speed can be estimated in two ways.
+ *
+ * SPEED_COUNT counts edges in each tick and uses the moving averager.
+ * At low speeds there are few edges per tick so the estimate moves in
+ * coarse steps and lags by several ticks.
+ *
+ * SPEED_BLENDED also times the interval between edges. Below about two
+ * edges per tick the speed is taken as one count divided by that
+ * interval. Above that, the count method is used as before.
+ *
+ * SPEED_OBSERVER runs the motor model, from Km and Tm, forward one
+ * tick using the voltage that was applied. The predicted position is
+ * then corrected by a fraction of its difference from the encoder count.
+ * Both the position and speed come from the observer so there is
+ * almost no lag, just the encoder quantisation.
+ *
+ * Select the method with the speedMode setting. It is best to change
+ * it only while the motor is idle.
+ */
+enum SpeedMode : uint8_t {
+  SPEED_COUNT = 0,
+  SPEED_BLENDED = 1,
+  SPEED_OBSERVER = 2,
+};
+
+// the averager total below which the edge period is used
+const int BLEND_COUNTS = 2 * AVERAGER_LENGTH;
+// with no edge for this many ticks, the wheel is taken to be stopped
+const uint8_t EDGE_TIMEOUT_TICKS = 200;
+// m_edge_period when there is no valid period
+const uint16_t NO_EDGE_PERIOD = 0xFFFF;
+
+/***
+ * Both observer poles are placed at this frequency. Higher tracks
+ * changes faster but lets through more of the encoder quantisation.
+ * It should be several times faster than the position controller.
+ */
+const float OBSERVER_BANDWIDTH = 20.0f; // Hz
+
 class Encoders;
 
 extern Encoders encoders;
@@ -104,39 +177,132 @@ public:
       bitSet(EICRA, ISC10);
       bitSet(EIMSK, INT1);
     }
+    load_coefficients();
     reset();
   }
 
+  /***
+   * Work out the observer gains from the motor model in settings and
+   * the loop interval. For the model
+   *
+   *   speed' = (Km * volts - speed) / Tm
+   *
+   * one tick forward is
+   *
+   *   speed = speed * decay + volts * gain
+   *
+   * The two corrections are chosen so that the estimation error dies
+   * away with both poles at p = exp(-2 * PI * OBSERVER_BANDWIDTH * T).
+   *
+   * The observer works in counts so Km is converted from degrees.
+   *
+   * Call this whenever Km, Tm or the loop rate changes.
+   */
+  void load_coefficients() {
+    float interval = loop_time.interval();
+    float tm = max(settings.data.Tm, 4 * interval);
+    float decay = 1.0f - interval / tm;
+    float p = expf(-2 * PI * OBSERVER_BANDWIDTH * interval);
+    float p2 = p * p / decay;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      m_obs_decay = decay;
+      m_obs_gain = settings.data.Km * COUNTS_PER_DEG * interval / tm;
+      m_obs_pos_gain = 1.0f - p2;
+      m_obs_speed_gain = (p2 + decay - 2 * p) / interval;
+    }
+  }
+
   void reset() {
     ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      m_quad_state = read_quad_state(PIND);
+      m_quad_errors = 0;
       m_right_counter = 0;
-      m_robot_distance = 0;
+      m_robot_position = Position();
       for (int i = 0; i < AVERAGER_LENGTH; i++) {
         m_right_history[i] = 0;
       }
       m_right_averager_total = 0;
       m_right_total = 0;
+      m_obs_offset = 0;
+      m_obs_speed = 0;
+      m_speed = 0;
+      m_edge_delta = 0;
+      m_edge_period = NO_EDGE_PERIOD;
+      m_ticks_since_edge = EDGE_TIMEOUT_TICKS;
+    }
+  }
+
+  /***
+   * The encoder CLK pin carries A XOR B and the DIR pin carries B.
+   * Undo the XOR to get back the two quadrature phases.
+   */
+  static uint8_t read_quad_state(uint8_t pins) {
+    uint8_t state = 0;
+    if (pins & ENCODER_DIR_MASK) {
+      state = 0x03;
     }
+    if (pins & ENCODER_CLK_MASK) {
+      state ^= 0x02;
+    }
+    return state;
   }
 
-  void encoder_input_change() {
-    static bool oldA = false;
-    static bool oldB = false;
-    bool newB = digitalRead(ENCODER_DIR);
-    bool newA = digitalRead(ENCODER_CLK) ^ newB;
-    int delta = ENCODER_POLARITY * ((oldA ^ newB) - (newA ^ oldB));
+  /***
+   * The timestamp is in Timer 2 counts from loop_time.timestamp().
+   * The period between edges only counts if both edges were in the
+   * same direction.
+   */
+  void encoder_input_change(uint16_t timestamp) {
+    uint8_t state = read_quad_state(PIND);
+    int8_t delta = pgm_read_byte(QUAD_TABLE + ((m_quad_state << 2) | state));
+    m_quad_state = state;
+    if (delta == QUAD_ERROR) {
+      m_quad_errors++;
+      return;
+    }
     m_right_counter += delta;
-    oldA = newA;
-    oldB = newB;
+    if (delta == m_edge_delta) {
+      m_edge_period = timestamp - m_edge_time;
+    } else {
+      m_edge_period = NO_EDGE_PERIOD;
+    }
+    m_edge_delta = delta;
+    m_edge_time = timestamp;
+  }
+
+  uint16_t quad_errors() {
+    uint16_t errors;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) { errors = m_quad_errors; }
+    return errors;
   }
 
-  void update() {
+  int32_t right_total() {
+    int32_t total;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) { total = m_right_total; }
+    return total;
+  }
+
+  /***
+   * Called from systick. The volts are those applied to the motor
+   * during the tick that has just finished. Only the observer uses them.
+   */
+  void update(real_t volts) {
     int right_delta = 0;
+    uint16_t edge_period;
+    uint16_t since_edge;
+    int8_t edge_delta;
     // Make sure values don't change while being read. Be quick.
     ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
       right_delta = m_right_counter;
       m_right_counter = 0;
       m_right_total += right_delta;
+      // the timestamps wrap so, after a timeout, the next edge has no period
+      if (m_ticks_since_edge >= EDGE_TIMEOUT_TICKS) {
+        m_edge_delta = 0;
+      }
+      edge_period = m_edge_period;
+      edge_delta = m_edge_delta;
+      since_edge = loop_time.timestamp() - m_edge_time;
     }
     // update the moving average
     m_right_averager_total -= m_right_history[m_averager_index];
@@ -147,39 +313,130 @@ public:
     if (m_averager_index >= AVERAGER_LENGTH) {
       m_averager_index = 0;
     }
-    float right_change = m_right_averager_total * (1.0 / AVERAGER_LENGTH) * DEG_PER_COUNT;
-    m_fwd_change = right_change;
-    m_robot_distance += m_fwd_change;
+    Position measured(m_right_total);
+
+    if (settings.data.speedMode == SPEED_OBSERVER) {
+      update_observer(volts, right_delta);
+      Position position = measured;
+      position += m_obs_offset;
+      m_fwd_change = position - m_robot_position;
+      m_robot_position = position;
+      m_speed = m_obs_speed;
+      return;
+    }
+
+    m_fwd_change = real_t(m_right_averager_total) * AVERAGER_SCALE;
+    m_robot_position += m_fwd_change;
+
+    if (right_delta != 0) {
+      m_ticks_since_edge = 0;
+    } else if (m_ticks_since_edge < EDGE_TIMEOUT_TICKS) {
+      m_ticks_since_edge++;
+    }
+    if (settings.data.speedMode == SPEED_BLENDED && abs(m_right_averager_total) < BLEND_COUNTS) {
+      m_speed = period_speed(edge_period, since_edge, edge_delta);
+    } else {
+      m_speed = m_fwd_change * (int)loop_time.frequency();
+    }
+    // keep the observer ready in case it gets selected
+    m_obs_offset = m_robot_position - measured;
+    m_obs_speed = m_speed;
+  }
+
+  /***
+   * Predict one tick ahead with the motor model, then correct
+   * the prediction with the measured position.
+   *
+   * The observer position is kept as an offset from the encoder
+   * count so that it only needs a small real_t. The prediction
+   * error is the predicted position less the new count.
+   */
+  void update_observer(real_t volts, int right_delta) {
+    real_t error = m_obs_offset + m_obs_speed * loop_time.interval_c() - real_t(right_delta);
+    real_t speed = m_obs_speed * m_obs_decay + volts * m_obs_gain;
+    m_obs_offset = error - error * m_obs_pos_gain;
+    m_obs_speed = speed - error * m_obs_speed_gain;
   }
 
+  /***
+   * Speed from the time between the last two edges. If it is already
+   * longer than that since the last edge, the wheel must be slowing
+   * down so that longer time is used instead.
+   *
+   * This needs a division but it is only done at low speeds.
+   */
+  real_t period_speed(uint16_t period, uint16_t since_edge, int8_t direction) {
+    if (m_ticks_since_edge >= EDGE_TIMEOUT_TICKS || period == NO_EDGE_PERIOD) {
+      return 0;
+    }
+    if (since_edge > period) {
+      period = since_edge;
+    }
+    if (period == 0) {
+      return m_speed;
+    }
+    float counts_per_second = TIMER2_COUNTS_PER_TICK * (float)loop_time.frequency();
+    return real_t(direction * counts_per_second / period);
+  }
+
+  // in degrees
   float robot_distance() {
-    float distance;
-    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) { distance = m_robot_distance; }
-    return distance;
+    Position position;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) { position = m_robot_position; }
+    return position.to_degrees();
   }
 
+  // in degrees per second
   float robot_speed() {
-    float speed;
-    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) { speed = LOOP_FREQUENCY * m_fwd_change; }
-    return speed;
+    real_t speed;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) { speed = m_speed; }
+    return float(speed) * DEG_PER_COUNT;
   }
 
+  // in degrees
   float robot_fwd_change() {
-    float distance;
-    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) { distance = m_fwd_change; }
-    return distance;
+    real_t change;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) { change = m_fwd_change; }
+    return float(change) * DEG_PER_COUNT;
+  }
+
+  // Only for use from within systick where there is no need for a guard
+  const Position &robot_position_isr() {
+    return m_robot_position;
+  }
+
+  // in counts per second
+  real_t speed_isr() {
+    return m_speed;
   }
 
-  int m_right_total;
+  int32_t m_right_total;
 
   // None of the variables in this file should be directly available to the rest
   // of the code without a guard to ensure atomic access
 private:
-  volatile float m_robot_distance;
-  // the change in angle in the last tick.
-  float m_fwd_change;
+  // everything in here is in encoder counts
+  Position m_robot_position;
+  // the change in position in the last tick.
+  real_t m_fwd_change;
+  // in counts per second
+  real_t m_speed;
+  // observer state and gains. See load_coefficients()
+  real_t m_obs_offset; // observer position less the encoder count
+  real_t m_obs_speed;
+  coeff_t m_obs_decay;
+  real_t m_obs_gain;
+  coeff_t m_obs_pos_gain;
+  real_t m_obs_speed_gain;
+  // timing of the last two edges, in Timer 2 counts
+  uint16_t m_edge_time;
+  uint16_t m_edge_period;
+  int8_t m_edge_delta;
+  uint8_t m_ticks_since_edge;
   // internal use only to track encoder input edges
   int m_right_counter;
+  uint8_t m_quad_state;
+  uint16_t m_quad_errors;
 
   int8_t m_right_history[AVERAGER_LENGTH];
   int m_averager_index;
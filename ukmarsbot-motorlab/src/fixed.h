@@ -0,0 +1,140 @@
+#ifndef FIXED_H
+#define FIXED_H
+
+#include "../config.h"
+#include <math.h>
+#include <stdint.h>
+
+/***
+ * Fixed point arithmetic for the systick control path.
+ *
+ * The ATmega328 has no floating point hardware so every float add,
+ * compare or multiply is a library call taking 100 cycles or more.
+ * A 32 bit fixed point add or compare is just four instructions and a
+ * multiply can be built from 16x16 bit partial products that make use
+ * of the hardware multiplier.
+ *
+ * Two formats are used:
+ *   real_t  - Q16.16 for positions, speeds and voltages
+ *   coeff_t - Q8.24 for small gains and scale factors
+ *
+ * The range of a real_t is +/- 32767 so absolute positions are not
+ * kept in a real_t. See position.h
+ *
+ * With CONTROL_FIXED_POINT set to 0 in config.h, both types are simply
+ * float and the code compiles exactly as it did before.
+ *
+ * test/test_fixed builds the controller and feedforward code of
+ * src/control.h in both formats. It feeds both the setpoints of a
+ * default MOVE and checks that the fixed point motor volts stay within
+ * 0.01V of the float version, and that gains at their limits saturate
+ * rather than wrap. Run it with 'pio test -e native'.
+ */
+
+/***
+ * Multiply two raw fixed point values. The value b has 'shift'
+ * fractional bits and the result keeps the format of a. Any shift
+ * from 16 to 31 is valid.
+ *
+ * The full 64 bit product is never formed because avr-gcc makes a
+ * slow job of that. Instead four 16x16 bit partial products are
+ * summed in unsigned arithmetic so that wrap-around is well defined.
+ * For shift == 16 the result is exact. Larger shifts may truncate
+ * by a couple of LSBs.
+ */
+inline int32_t fixed_mul(int32_t a, int32_t b, uint8_t shift) {
+  int16_t ah = a >> 16;
+  uint16_t al = a & 0xFFFF;
+  int16_t bh = b >> 16;
+  uint16_t bl = b & 0xFFFF;
+  uint32_t hi = (uint32_t)((int32_t)ah * bh);
+  int32_t mid1 = (int32_t)ah * bl;
+  int32_t mid2 = (int32_t)bh * al;
+  uint32_t lo = (uint32_t)al * bl;
+  uint32_t result = hi << (32 - shift);
+  result += (uint32_t)(mid1 >> (shift - 16));
+  result += (uint32_t)(mid2 >> (shift - 16));
+  result += lo >> shift;
+  return (int32_t)result;
+}
+
+template <uint8_t FRAC_BITS>
+class Fixed {
+  static_assert(FRAC_BITS >= 16 && FRAC_BITS < 32, "Fixed needs 16 to 31 fractional bits");
+
+public:
+  constexpr Fixed() : m_raw(0) {}
+  constexpr Fixed(int value) : m_raw((int32_t)value * (1L << FRAC_BITS)) {}
+  constexpr Fixed(long value) : m_raw((int32_t)value * (1L << FRAC_BITS)) {}
+  constexpr Fixed(float value) : m_raw((int32_t)(value * (1L << FRAC_BITS) + (value < 0 ? -0.5f : 0.5f))) {}
+  constexpr Fixed(double value) : Fixed((float)value) {}
+
+  // from another format. Losing fractional bits truncates.
+  template <uint8_t F>
+  explicit Fixed(Fixed<F> x)
+      : m_raw(F > FRAC_BITS ? x.raw() >> ((F - FRAC_BITS) & 31) : x.raw() << ((FRAC_BITS - F) & 31)) {}
+
+  static Fixed from_raw(int32_t raw) {
+    Fixed f;
+    f.m_raw = raw;
+    return f;
+  }
+
+  int32_t raw() const { return m_raw; }
+
+  explicit operator float() const { return m_raw * (1.0f / (1L << FRAC_BITS)); }
+  explicit operator int() const { return (int)(m_raw >> FRAC_BITS); }
+
+  Fixed operator-() const { return from_raw(-m_raw); }
+  Fixed operator+(Fixed b) const { return from_raw(m_raw + b.m_raw); }
+  Fixed operator-(Fixed b) const { return from_raw(m_raw - b.m_raw); }
+  Fixed &operator+=(Fixed b) {
+    m_raw += b.m_raw;
+    return *this;
+  }
+  Fixed &operator-=(Fixed b) {
+    m_raw -= b.m_raw;
+    return *this;
+  }
+
+  // The result always has the format of the left hand operand
+  template <uint8_t F>
+  Fixed operator*(Fixed<F> b) const { return from_raw(fixed_mul(m_raw, b.raw(), F)); }
+  Fixed operator*(int n) const { return from_raw(m_raw * n); }
+
+  bool operator<(Fixed b) const { return m_raw < b.m_raw; }
+  bool operator>(Fixed b) const { return m_raw > b.m_raw; }
+  bool operator<=(Fixed b) const { return m_raw <= b.m_raw; }
+  bool operator>=(Fixed b) const { return m_raw >= b.m_raw; }
+  bool operator==(Fixed b) const { return m_raw == b.m_raw; }
+  bool operator!=(Fixed b) const { return m_raw != b.m_raw; }
+
+private:
+  int32_t m_raw;
+};
+
+// lets the same code call fabsf() on either a float or a Fixed
+template <uint8_t F>
+inline Fixed<F> fabsf(Fixed<F> x) {
+  return (x.raw() < 0) ? -x : x;
+}
+
+// the shift in operator int() already rounds down, even for negative values
+template <uint8_t F>
+inline int floor_int(Fixed<F> x) {
+  return int(x);
+}
+
+inline int floor_int(float x) {
+  return (int)floorf(x);
+}
+
+#if CONTROL_FIXED_POINT
+typedef Fixed<16> real_t;
+typedef Fixed<24> coeff_t;
+#else
+typedef float real_t;
+typedef float coeff_t;
+#endif
+
+#endif
@@ -0,0 +1,129 @@
+#ifndef LOOPTIME_H
+#define LOOPTIME_H
+
+#include "../config.h"
+#include "fixed.h"
+#include <Arduino.h>
+#include <util/atomic.h>
+
+/***
+ * The systick control loop can run at 250Hz, 500Hz, 1kHz or 2kHz.
+ *
+ * Timer 2 always counts 250 clocks per tick. Only the prescaler
+ * changes with the loop rate so OCR2A stays at 249 and TCNT2 always
+ * covers exactly one tick.
+ *
+ * Everything that depends on the loop rate gets it from here rather
+ * than from the LOOP_FREQUENCY constant, which is now just the default.
+ * The frequency and interval are floats for use outside the ISR. The
+ * interval is also kept as a coeff_t for the control code in systick.
+ *
+ * LoopTime also counts the ticks. Together with TCNT2, the tick count
+ * gives a free running timestamp with a resolution of one timer count.
+ */
+
+const uint8_t TIMER2_COUNTS_PER_TICK = 250;
+
+class LoopTime;
+extern LoopTime loop_time;
+
+class LoopTime {
+public:
+  LoopTime() {
+    set_frequency(LOOP_FREQUENCY);
+  }
+
+  /***
+   * Select a new loop rate. This only changes the stored values. It
+   * is up to the caller to reprogram the timer and anything else
+   * that has been precomputed from the old rate.
+   *
+   * Returns false, leaving everything as it was, if the rate is not
+   * one of those supported.
+   */
+  bool set_frequency(uint16_t frequency) {
+    uint8_t clock_select;
+    switch (frequency) {
+      case 250:
+        clock_select = _BV(CS22) | _BV(CS21); // divide by 256
+        break;
+      case 500:
+        clock_select = _BV(CS22) | _BV(CS20); // divide by 128
+        break;
+      case 1000:
+        clock_select = _BV(CS22); // divide by 64
+        break;
+      case 2000:
+        clock_select = _BV(CS21) | _BV(CS20); // divide by 32
+        break;
+      default:
+        return false;
+    }
+    float interval = 1.0f / frequency;
+    coeff_t interval_c = interval;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      m_frequency = frequency;
+      m_clock_select = clock_select;
+      m_interval = interval;
+      m_interval_c = interval_c;
+    }
+    return true;
+  }
+
+  uint16_t frequency() { return m_frequency; }
+  float interval() { return m_interval; }
+  coeff_t interval_c() { return m_interval_c; }
+  uint8_t clock_select() { return m_clock_select; }
+
+  // the time represented by one count of TCNT2
+  float us_per_count() {
+    return 1.0e6f * m_interval / TIMER2_COUNTS_PER_TICK;
+  }
+
+  /***
+   * Call from the Timer 2 ISR before interrupts are re-enabled so
+   * that no other ISR can ever see TCNT2 and the tick count disagree.
+   */
+  void count_tick() {
+    m_ticks++;
+  }
+
+  uint32_t ticks() {
+    uint32_t ticks;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      ticks = m_ticks;
+    }
+    return ticks;
+  }
+
+  // only from within the systick ISR where the count cannot change
+  uint32_t ticks_isr() {
+    return m_ticks;
+  }
+
+  /***
+   * A timestamp in Timer 2 counts. It wraps after 65536 counts which
+   * is a little over 262 ticks.
+   *
+   * Call with interrupts disabled. If the timer has rolled over but
+   * the systick ISR has not yet started, the pending compare flag
+   * means the tick count is one behind.
+   */
+  uint16_t timestamp() {
+    uint8_t count = TCNT2;
+    uint16_t ticks = m_ticks;
+    if (bit_is_set(TIFR2, OCF2A) && count < TIMER2_COUNTS_PER_TICK / 2) {
+      ticks++;
+    }
+    return ticks * TIMER2_COUNTS_PER_TICK + count;
+  }
+
+private:
+  volatile uint32_t m_ticks = 0;
+  uint16_t m_frequency;
+  uint8_t m_clock_select;
+  float m_interval;
+  coeff_t m_interval_c;
+};
+
+#endif
@@ -34,11 +34,26 @@
 #define MOTORS_H
 
 #include "../config.h"
+#include "control.h"
+#include "current.h"
 #include "encoders.h"
+#include "fixed.h"
+#include "looptime.h"
 #include "profile.h"
 #include "settings.h"
 #include <Arduino.h>
 
+const real_t MAX_VOLTS = MAX_MOTOR_VOLTS;
+
+/***
+ * The motor output is written directly to the hardware. The PWM goes
+ * to the Timer 1 compare register and the direction bit to PORTB.
+ */
+static_assert(MOTOR_PWM == 10, "MOTOR_PWM must be the OC1B pin");
+static_assert(MOTOR_DIR >= 8 && MOTOR_DIR < 14, "MOTOR_DIR must be on port B");
+const uint8_t MOTOR_DIR_MASK = 1 << (MOTOR_DIR - 8);
+const real_t BIAS_THRESHOLD = 0.1f * COUNTS_PER_DEG;
+
 enum { PWM_488_HZ,
        PWM_3906_HZ,
        PWM_31250_HZ };
@@ -70,6 +85,26 @@ public:
     m_previous_error = 0;
   }
 
+  /***
+   * The controllers work with their own copies of the settings in
+   * the number format used by the control path. Any conversion and
+   * scaling is done once, here, rather than on every tick.
+   *
+   * The settings are per degree but the control path works in encoder
+   * counts so everything is scaled by DEG_PER_COUNT. See src/control.h
+   *
+   * Call this whenever the settings change.
+   */
+  void load_coefficients() {
+    ControlGains<real_t, coeff_t> gains;
+    gains.load(settings.data.Kp, settings.data.Kd, settings.data.speedFF, settings.data.accFF,
+               settings.data.biasFF, DEG_PER_COUNT, loop_time.frequency());
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      m_gains = gains;
+      m_conductance = 1.0f / MOTOR_RESISTANCE;
+    }
+  }
+
   void stop() {
     disable_controllers();
     set_motor_volts(0);
@@ -80,7 +115,11 @@ public:
     pinMode(MOTOR_PWM, OUTPUT);
     digitalWrite(MOTOR_PWM, 0);
     digitalWrite(MOTOR_DIR, 0);
+    OCR1B = 0;
+    bitSet(TCCR1A, COM1B1); // the timer drives the pin from now on
     set_pwm_frequency(PWM_31250_HZ);
+    set_pwm_resolution(PWM_BITS);
+    load_coefficients();
     stop();
   }
 
@@ -93,15 +132,15 @@ public:
    *
    * TODO: it would be nice not to have to access global objects here
    */
-  float position_controller() {
+  real_t position_controller() {
     // you can integrate here by adding and subtracting deltas
     // m_error += profile.increment() - encoders.robot_fwd_change();
-    // but conceptually, it is easier to directly compare positions
-    m_error = profile.position() - encoders.robot_distance();
-    float diff = m_error - m_previous_error;
+    // but conceptually, it is easier to directly compare positions.
+    // Both are whole counts plus a fraction so the difference is exact.
+    m_error = profile.position_isr() - encoders.robot_position_isr();
+    real_t diff = m_error - m_previous_error;
     m_previous_error = m_error;
-    float output = settings.data.Kp * m_error + settings.data.Kd * diff * LOOP_FREQUENCY;
-    return output;
+    return m_gains.position_output(m_error, diff);
   }
 
   /***
@@ -111,42 +150,72 @@ public:
    * If used with PID, a simpler, single value will be sufficient.
    *
    * Note: Multiply by (1/x) is more efficient than just divide by x
+   *
+   * The acceleration is the change in speed over the last tick. It
+   * comes straight from the profile so there is no need to
+   * differentiate the speed here.
    */
 
-  float feed_forward(float speed) {
-    static float oldSpeed = 0;
-    float feedforward = speed * settings.data.speedFF;
-    float acc = (speed - oldSpeed) * LOOP_FREQUENCY;
-    oldSpeed = speed;
-    float accFF = settings.data.accFF * acc;
-    feedforward += accFF;
-    if (speed > 0.1) {
-      feedforward += settings.data.biasFF;
-    }
-    if (speed < -0.1) {
-      feedforward -= settings.data.biasFF;
-    }
-    return feedforward;
+  real_t feed_forward(real_t speed, real_t acceleration) {
+    return m_gains.feed_forward(speed, acceleration, BIAS_THRESHOLD);
   }
 
   void update_controllers() {
-    float output = 0;
+    real_t output = 0;
     m_ctrl_volts = position_controller();
     if (m_controller_output_enabled) {
       output += m_ctrl_volts;
     }
 
-    m_ff_volts = feed_forward(profile.speed());
+    m_ff_volts = feed_forward(profile.speed_isr(), profile.acceleration_isr());
     if (m_feedforward_enabled) {
       output += m_ff_volts;
     }
+#if CURRENT_SENSE
+    if (current_loop.is_enabled()) {
+      update_current_demand(output);
+      return;
+    }
+#endif
     if (m_closed_loop) {
       set_motor_volts(output);
     }
   }
 
-  void set_battery_compensation(float comp) {
-    m_battery_compensation = comp;
+  /***
+   * With the current loop running, the controller output becomes a
+   * current demand. The back EMF is taken out first, because it does
+   * not drive any current, and the current loop is given the back EMF
+   * for the measured speed instead. When the motor follows the profile
+   * the two are the same and the output voltage is just as it would
+   * be without the current loop. See src/current.h
+   */
+#if CURRENT_SENSE
+  void update_current_demand(real_t output) {
+    if (!m_closed_loop) {
+      current_loop.release();
+      return;
+    }
+    if (m_feedforward_enabled) {
+      output -= m_gains.speed_output(profile.speed_isr());
+    }
+    real_t back_emf = m_gains.speed_output(encoders.speed_isr());
+    current_loop.set_demand(output * m_conductance, back_emf);
+  }
+#endif
+
+  /***
+   * The compensation from the ADC is in PWM counts per volt for 8 bit
+   * PWM. It is scaled here to suit the PWM resolution in use so that
+   * set_motor_volts() needs only the one multiply.
+   *
+   * Called from the main loop while systick may be using the old value.
+   */
+  void set_battery_compensation(real_t comp) {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      m_battery_comp_8bit = comp;
+      m_battery_compensation = comp * m_pwm_scale;
+    }
   }
 
   int get_fwd_millivolts() {
@@ -154,31 +223,82 @@ public:
   }
 
   float get_motor_volts() {
-    float volts = 0;
+    real_t volts = 0;
     ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
       volts = m_motor_volts;
     }
-    return volts;
+    return float(volts);
   }
 
-  void set_motor_volts(float volts) {
-    volts = constrain(volts, -MAX_MOTOR_VOLTS, MAX_MOTOR_VOLTS);
+  void set_motor_volts(real_t volts) {
+    volts = constrain(volts, -MAX_VOLTS, MAX_VOLTS);
     m_motor_volts = volts;
     int motorPWM = (int)(volts * m_battery_compensation);
     set_motor_pwm(motorPWM);
   }
 
+  /***
+   * Writes the direction bit and OCR1B directly. digitalWrite() and
+   * analogWrite() take several microseconds each and analogWrite()
+   * only handles 8 bits.
+   *
+   * This is called from systick and from the main loop. The guard
+   * stops systick getting in between the 16 bit write to OCR1B, which
+   * shares a temporary register with the other Timer 1 registers, and
+   * keeps the direction and duty cycle together.
+   */
   void set_motor_pwm(int pwm) {
-    pwm = MOTOR_POLARITY * constrain(pwm, -255, 255);
-    if (pwm < 0) {
-      digitalWrite(MOTOR_DIR, 1);
-      analogWrite(MOTOR_PWM, -pwm);
-    } else {
-      digitalWrite(MOTOR_DIR, 0);
-      analogWrite(MOTOR_PWM, pwm);
+    pwm = MOTOR_POLARITY * constrain(pwm, -m_pwm_top, m_pwm_top);
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      if (pwm < 0) {
+        PORTB |= MOTOR_DIR_MASK;
+        OCR1B = -pwm;
+      } else {
+        PORTB &= ~MOTOR_DIR_MASK;
+        OCR1B = pwm;
+      }
     }
   }
 
+  /***
+   * Timer 1 runs in phase correct PWM mode with a TOP of 255, 511 or
+   * 1023 for 8, 9 or 10 bits. Each extra bit halves the PWM frequency.
+   * With no prescaler, that is 31.25kHz, 15.6kHz and 7.8kHz.
+   *
+   * Returns false, and changes nothing, unless bits is 8, 9 or 10.
+   * Best done while the motor is idle.
+   */
+  bool set_pwm_resolution(uint8_t bits) {
+    uint8_t wgm;
+    switch (bits) {
+      case 8:
+        wgm = _BV(WGM10);
+        break;
+      case 9:
+        wgm = _BV(WGM11);
+        break;
+      case 10:
+        wgm = _BV(WGM11) | _BV(WGM10);
+        break;
+      default:
+        return false;
+    }
+    int top = (1 << bits) - 1;
+    real_t scale = top / 255.0f;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      TCCR1B &= ~(_BV(WGM13) | _BV(WGM12));
+      TCCR1A = (TCCR1A & ~(_BV(WGM11) | _BV(WGM10))) | wgm;
+      m_pwm_bits = bits;
+      m_pwm_top = top;
+      m_pwm_scale = scale;
+      set_battery_compensation(m_battery_comp_8bit);
+      set_motor_volts(m_motor_volts);
+    }
+    return true;
+  }
+
+  uint8_t pwm_bits() { return m_pwm_bits; }
+
   void set_pwm_frequency(int frequency = PWM_31250_HZ) {
     switch (frequency) {
       case PWM_31250_HZ:
@@ -204,12 +324,22 @@ public:
   bool m_controller_output_enabled = true;
   bool m_feedforward_enabled = true;
   bool m_closed_loop = true;
-  float m_previous_error;
-  float m_error;
-  float m_ctrl_volts;
-  float m_ff_volts;
-  float m_battery_compensation = 1.0f;
-  float m_motor_volts;
+  real_t m_previous_error;
+  real_t m_error; // in encoder counts
+  real_t m_ctrl_volts;
+  real_t m_ff_volts;
+  real_t m_battery_compensation = 1.0f; // scaled for the PWM resolution
+  real_t m_motor_volts;
+
+private:
+  // working copies of the settings. See load_coefficients()
+  ControlGains<real_t, coeff_t> m_gains;
+  real_t m_conductance; // of the motor winding, for the current loop
+  // PWM resolution. See set_pwm_resolution()
+  uint8_t m_pwm_bits = 8;
+  int m_pwm_top = 255;
+  real_t m_pwm_scale = 1.0f;
+  real_t m_battery_comp_8bit = 1.0f;
 };
 
 extern Motors motors;
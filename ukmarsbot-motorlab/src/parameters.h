@@ -0,0 +1,151 @@
+#ifndef PARAMETERS_H
+#define PARAMETERS_H
+
+#include "../config.h"
+#include "encoders.h"
+#include "settings.h"
+#include "utils.h"
+#include <Arduino.h>
+#include <stddef.h>
+
+/***
+ * The tunable settings are described by a table in flash rather than
+ * by a command each. Any name in the table can be typed at the command
+ * line, optionally with a new value, and several can go on one line:
+ *
+ *     KP = 1.5 KD = 0.02 ZETA = 0.7
+ *
+ * Each row gives the offset of the value in Settings::Data, its type,
+ * the limits for a new value, how many decimals to print it with and
+ * what has to be worked out again when it changes. Adding a tunable
+ * only needs a new field in Settings::Data and a row here.
+ *
+ * accFF and KD are multiplied by DEG_PER_COUNT and the loop frequency
+ * and kept as a real_t, which only goes up to 32767. Their limit of 2.5
+ * leaves room for 2000Hz with the motorlab encoder. The products they
+ * go into are saturated. See src/control.h
+ *
+ * Each row also holds a hash of the name, worked out by the compiler.
+ * A lookup only has to compare one 16 bit word per row and then check
+ * the name of the row that matches. See name_hash() in utils.h
+ *
+ * The '$' command prints every parameter in the table order.
+ */
+
+enum ParameterType : uint8_t {
+  PARAM_FLOAT = 0,
+  PARAM_UINT8,
+  PARAM_UINT16,
+};
+
+// what needs to be done after a change, or-ed together
+enum ParameterFlags : uint8_t {
+  PARAM_READ_ONLY = 0x01,
+  PARAM_RELOAD_MOTORS = 0x02,
+  PARAM_RELOAD_ENCODERS = 0x04,
+  PARAM_RELOAD_LOOP = 0x08,
+};
+
+const uint8_t PARAM_NAME_LENGTH = 12;
+
+struct Parameter {
+  uint16_t hash;
+  char name[PARAM_NAME_LENGTH];
+  uint8_t offset;
+  uint8_t type;
+  uint8_t decimals;
+  uint8_t flags;
+  float min;
+  float max;
+};
+
+#define PARAMETER(name, field, type, decimals, min, max, flags) \
+  { name_hash(name), name, offsetof(Settings::Data, field), type, decimals, flags, min, max }
+
+/* clang-format off */
+const Parameter PARAMETERS[] PROGMEM = {
+  PARAMETER("degPerCount", degPerCount, PARAM_FLOAT,  5,   0, 0,     PARAM_READ_ONLY),
+  PARAMETER("Km",          Km,          PARAM_FLOAT,  2,   0, 10000, PARAM_RELOAD_ENCODERS),
+  PARAMETER("Tm",          Tm,          PARAM_FLOAT,  5,   0, 10,    PARAM_RELOAD_ENCODERS),
+  PARAMETER("biasFF",      biasFF,      PARAM_FLOAT,  5,   0, 10,    PARAM_RELOAD_MOTORS),
+  PARAMETER("speedFF",     speedFF,     PARAM_FLOAT,  5,   0, 10,    PARAM_RELOAD_MOTORS),
+  PARAMETER("accFF",       accFF,       PARAM_FLOAT,  5,   0, 2.5,   PARAM_RELOAD_MOTORS),
+  PARAMETER("zeta",        zeta,        PARAM_FLOAT,  5,   0, 10,    0),
+  PARAMETER("Td",          Td,          PARAM_FLOAT,  5,   0, 1,     0),
+  PARAMETER("KP",          Kp,          PARAM_FLOAT,  5,   0, 10,    PARAM_RELOAD_MOTORS),
+  PARAMETER("KD",          Kd,          PARAM_FLOAT,  5,   0, 2.5,   PARAM_RELOAD_MOTORS),
+  PARAMETER("loopHz",      loopHz,      PARAM_UINT16, 0, 250, 2000,  PARAM_RELOAD_LOOP),
+  PARAMETER("speedMode",   speedMode,   PARAM_UINT8,  0, SPEED_COUNT, SPEED_OBSERVER, 0),
+};
+/* clang-format on */
+
+const uint8_t PARAMETER_COUNT = sizeof(PARAMETERS) / sizeof(PARAMETERS[0]);
+
+// Returns the index of the named parameter or -1 if there is none
+inline int8_t find_parameter(const char *name) {
+  uint16_t hash = hash_name(name);
+  for (uint8_t i = 0; i < PARAMETER_COUNT; i++) {
+    if (pgm_read_word(&PARAMETERS[i].hash) == hash && strcasecmp_P(name, PARAMETERS[i].name) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+inline float get_parameter(uint8_t index) {
+  const uint8_t *data = (const uint8_t *)&settings.data + pgm_read_byte(&PARAMETERS[index].offset);
+  switch (pgm_read_byte(&PARAMETERS[index].type)) {
+    case PARAM_UINT8:
+      return *data;
+    case PARAM_UINT16:
+      return *(const uint16_t *)data;
+  }
+  return *(const float *)data;
+}
+
+/***
+ * Store a new value, limited to the range in the table. Returns the
+ * flags that say what needs to be done about it, or 0 if the value
+ * cannot be changed.
+ */
+inline uint8_t set_parameter(uint8_t index, float value) {
+  Parameter param;
+  memcpy_P(&param, &PARAMETERS[index], sizeof(param));
+  if (param.flags & PARAM_READ_ONLY) {
+    return 0;
+  }
+  value = constrain(value, param.min, param.max);
+  uint8_t *data = (uint8_t *)&settings.data + param.offset;
+  switch (param.type) {
+    case PARAM_UINT8:
+      *data = lround(value);
+      break;
+    case PARAM_UINT16:
+      *(uint16_t *)data = lround(value);
+      break;
+    default:
+      *(float *)data = value;
+      break;
+  }
+  return param.flags;
+}
+
+inline void print_parameter(uint8_t index) {
+  Serial.print(get_parameter(index), pgm_read_byte(&PARAMETERS[index].decimals));
+}
+
+// the whole table, one parameter to a line, names lined up on the '='
+inline void print_parameters() {
+  for (uint8_t i = 0; i < PARAMETER_COUNT; i++) {
+    const char *name = PARAMETERS[i].name;
+    for (uint8_t n = strlen_P(name); n < 15; n++) {
+      Serial.write(' ');
+    }
+    Serial.print((const __FlashStringHelper *)name);
+    Serial.print(F(" = "));
+    print_parameter(i);
+    Serial.println();
+  }
+}
+
+#endif
@@ -0,0 +1,85 @@
+#ifndef POSITION_H
+#define POSITION_H
+
+#include "../config.h"
+#include "fixed.h"
+#include <Arduino.h>
+
+/***
+ * Absolute positions are kept as a 32 bit count of whole encoder
+ * counts plus a fraction of a count. The encoder itself only ever
+ * changes the whole counts so the measured position is exact, no
+ * matter how long the motor has been running. The fraction is needed
+ * for the profile setpoint which moves by less than one count in a
+ * tick at low speeds. It is a coeff_t so that the profile can add its
+ * per-tick increments without losing precision.
+ *
+ * The 32 bit count is good for millions of revolutions. Only the
+ * difference between two positions is ever used in the control code
+ * and that is returned as a real_t number of counts.
+ *
+ * Conversion to degrees happens only when a position is reported or
+ * set from the CLI.
+ */
+
+// differences between positions saturate at this many counts
+const int32_t POSITION_DIFF_LIMIT = 30000;
+
+class Position {
+public:
+  Position() : m_counts(0), m_fraction(0) {}
+  explicit Position(int32_t counts) : m_counts(counts), m_fraction(0) {}
+
+  static Position from_degrees(float degrees) {
+    return from_counts(degrees * COUNTS_PER_DEG);
+  }
+
+  static Position from_counts(float counts) {
+    float whole = floorf(counts);
+    Position p((int32_t)whole);
+    p.m_fraction = coeff_t(counts - whole);
+    return p;
+  }
+
+  float to_degrees() const {
+    return (m_counts + float(m_fraction)) * DEG_PER_COUNT;
+  }
+
+  int32_t counts() const { return m_counts; }
+  coeff_t fraction() const { return m_fraction; }
+
+  // move by some number of counts, whole or not
+  Position &operator+=(real_t change) {
+    int whole = floor_int(change);
+    m_counts += whole;
+    advance(coeff_t(change - real_t(whole)));
+    return *this;
+  }
+
+  Position &operator+=(const Position &change) {
+    m_counts += change.m_counts;
+    advance(change.m_fraction);
+    return *this;
+  }
+
+  // a small move, less than 127 counts. The fraction stays in [0,1)
+  void advance(coeff_t change) {
+    m_fraction += change;
+    int whole = floor_int(m_fraction);
+    m_counts += whole;
+    m_fraction -= coeff_t(whole);
+  }
+
+  // the distance from b to a in counts
+  friend real_t operator-(const Position &a, const Position &b) {
+    int32_t counts = a.m_counts - b.m_counts;
+    counts = constrain(counts, -POSITION_DIFF_LIMIT, POSITION_DIFF_LIMIT);
+    return real_t(counts) + real_t(a.m_fraction - b.m_fraction);
+  }
+
+private:
+  int32_t m_counts;
+  coeff_t m_fraction;
+};
+
+#endif
@@ -34,6 +34,10 @@
 #define PROFILE_H
 
 #include "../config.h"
+#include "fixed.h"
+#include "looptime.h"
+#include "position.h"
+#include "ringbuffer.h"
 #include <Arduino.h>
 #include <util/atomic.h>
 //***************************************************************************//
@@ -41,6 +45,115 @@ class Profile;
 
 extern Profile profile;
 
+/***
+ * The profile works in encoder counts so that the setpoint can be
+ * compared directly with the encoder position. Distances and speeds
+ * are given, and reported, in degrees.
+ *
+ * A move is planned in full, before it starts, as two changes of speed
+ * with a cruise in between, each a whole number of ticks. An S-curve
+ * move limits the jerk so each change of speed takes three phases:
+ * acceleration rising, constant and falling. That makes seven phases
+ * in all. A trapezoidal move is the same with no rising or falling
+ * phases, so it has three: accelerate, cruise and brake. Short moves
+ * have no cruise phase.
+ *
+ * Only the two ramps are stored. The phases follow from them so each
+ * one is worked out in the ISR as it starts. That is a few copies,
+ * not a table of seven phases for every move in the queue.
+ *
+ * The phase lengths are rounded up to whole ticks. The cruise speed is
+ * then solved so that the sum of the per-tick increments is exactly
+ * the move distance. The acceleration actually used is never more than
+ * the one asked for.
+ *
+ * Internally, speeds are in counts per tick and accelerations in counts
+ * per tick per tick. In the systick ISR, each tick just adds the jerk to
+ * the acceleration, the acceleration to the speed and the speed to the
+ * position. There is no braking distance to work out and no decision
+ * about when to brake. At the end of each phase the speed is set to its
+ * exact value and at the end of the move so is the position. Small
+ * rounding errors do not build up from one move to the next.
+ *
+ * Because the acceleration is known at every tick, the feedforward
+ * can use it directly rather than differentiating the speed.
+ *
+ * Planned moves wait in a queue. Each one is planned to start at the
+ * final speed of the one before so a move with a non-zero final speed
+ * runs straight into the next one. The systick ISR starts the next move
+ * on the same tick that the last one ends so there is no gap. start()
+ * clears the queue and begins a single move, as before. enqueue() adds
+ * a move to the end of the queue.
+ */
+
+const uint8_t PROFILE_PHASES = 7;
+const uint8_t BRAKE_PHASE = 4;
+
+struct ProfilePhase {
+  uint32_t ticks;
+  coeff_t start_acc; // acceleration before the first tick
+  coeff_t jerk;      // change in acceleration each tick
+  coeff_t end_speed; // exact speed at the end of the phase
+};
+
+// a change of speed. For a trapezoid, jerk_ticks is zero.
+struct SpeedRamp {
+  uint32_t jerk_ticks; // for the acceleration to rise, and again to fall
+  uint32_t acc_ticks;  // at constant acceleration in between
+  coeff_t jerk;        // change in acceleration each tick while it rises
+  coeff_t acc;         // the constant acceleration
+  coeff_t rise_speed;  // exact speeds at the end of each part
+  coeff_t hold_speed;
+  coeff_t end_speed;
+};
+
+struct MoveSegment {
+  SpeedRamp ramps[2]; // to the cruise speed, then to the final speed
+  uint32_t cruise_ticks;
+  Position distance;
+  coeff_t delta_v; // for ramp_to_target() once the move is over
+};
+
+// each segment takes 72 bytes of RAM. Two is enough to have the next
+// move ready when the one running ends.
+const uint8_t MOVE_QUEUE_LENGTH = 2;
+
+// one phase of a move, worked out from its ramps
+inline ProfilePhase move_phase(const MoveSegment &segment, uint8_t phase) {
+  if (phase == 3) {
+    coeff_t speed = segment.ramps[0].end_speed;
+    return {segment.cruise_ticks, coeff_t(0), coeff_t(0), speed};
+  }
+  const SpeedRamp &ramp = segment.ramps[phase / 4];
+  switch (phase % 4) {
+    case 0:
+      return {ramp.jerk_ticks, coeff_t(0), ramp.jerk, ramp.rise_speed};
+    case 1:
+      return {ramp.acc_ticks, ramp.acc, coeff_t(0), ramp.hold_speed};
+  }
+  return {ramp.jerk_ticks, ramp.acc, -ramp.jerk, ramp.end_speed};
+}
+
+/***
+ * The speed change in an S-curve ramp with nj ticks of rising
+ * acceleration, na ticks constant and nj ticks falling is
+ * J * nj * (nj + na) for a jerk of J per tick.
+ *
+ * This is the distance covered in the ramp, from rest, for J = 1.
+ * Working it out once, here, in closed form means that the distance
+ * of any ramp with the same tick counts is just a matter of scaling.
+ */
+inline float s_ramp_sum(uint32_t nj, uint32_t na) {
+  float j = nj;
+  float a = na;
+  float rise_gain = j * (j + 1) / 2;
+  float hold_gain = rise_gain + a * j;
+  float rise = j * (j + 1) * (j + 2) / 6;
+  float hold = a * rise_gain + j * a * (a + 1) / 2;
+  float fall = j * hold_gain + j * j * (j + 1) / 2 - j * (j + 1) * (j + 2) / 6;
+  return rise + hold + fall;
+}
+
 enum ProfileState : uint8_t {
   CS_IDLE = 0,
   CS_ACCELERATING = 1,
@@ -52,39 +165,197 @@ class Profile {
 public:
   void reset() {
     ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
-      m_position = 0;
+      m_queue.clear();
+      m_position = Position();
       m_speed = 0;
+      m_acc = 0;
+      m_tick_acc = 0;
       m_target_speed = 0;
+      m_frequency = loop_time.frequency();
       m_state = CS_IDLE;
     }
   }
 
-  bool is_finished() { return m_state == CS_FINISHED; }
+  // when the last queued move is complete
+  bool is_finished() { return m_state == CS_FINISHED && m_queue.is_empty(); }
+
+  bool queue_full() { return m_queue.is_full(); }
 
-  void start(float distance, float top_speed, float final_speed, float acceleration) {
-    m_sign = (distance < 0) ? -1 : +1;
-    if (distance < 0) {
-      distance = -distance;
+  /***
+   * Start a single move now, from the current speed. Anything in the
+   * queue is thrown away and the position starts again from zero.
+   *
+   * With a jerk of zero, the profile is trapezoidal. Otherwise it is an
+   * S-curve with the jerk limited to the given value in deg/s/s/s.
+   */
+  void start(float distance, float top_speed, float final_speed, float acceleration, float jerk = 0) {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      m_queue.clear();
+      m_position = Position();
+      m_state = CS_IDLE;
     }
-    if (distance < 1.0) {
+    enqueue(distance, top_speed, final_speed, acceleration, jerk);
+    if (m_queue.is_empty()) {
       m_state = CS_FINISHED;
-      return;
     }
+  }
+
+  /***
+   * Plan a move and add it to the end of the queue. All the arithmetic
+   * is done here, in float and in counts, so that the ISR has nothing
+   * to do but follow the plan.
+   *
+   * Returns false, and does nothing, if the queue is full. A move of
+   * less than one degree is ignored.
+   */
+  bool enqueue(float distance, float top_speed, float final_speed, float acceleration, float jerk = 0) {
+    if (m_queue.is_full()) {
+      return false;
+    }
+    int8_t sign = (distance < 0) ? -1 : +1;
+    distance = fabsf(distance);
+    if (distance < 1.0) {
+      return true;
+    }
+    top_speed = fabsf(top_speed) * COUNTS_PER_DEG;
+    final_speed = fabsf(final_speed) * COUNTS_PER_DEG;
     if (final_speed > top_speed) {
       final_speed = top_speed;
     }
+    acceleration = max(fabsf(acceleration) * COUNTS_PER_DEG, 1.0f);
+    jerk = fabsf(jerk) * COUNTS_PER_DEG;
+    distance = distance * COUNTS_PER_DEG;
+    float interval = loop_time.interval();
+    // start from the current speed or from where the last queued move ends
+    float v0 = m_queued_speed;
+    if (m_queue.is_empty()) {
+      coeff_t speed;
+      ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        speed = m_speed;
+      }
+      v0 = float(speed) * m_frequency;
+    }
+    v0 = sign * v0;
 
-    m_position = 0;
-    m_final_position = distance;
-    m_target_speed = m_sign * fabsf(top_speed);
-    m_final_speed = m_sign * fabsf(final_speed);
-    m_acceleration = fabsf(acceleration);
-    if (m_acceleration >= 1) {
-      m_one_over_acc = 1.0f / m_acceleration;
+    MoveSegment &segment = m_queue.back();
+    if (jerk > 0) {
+      plan_s_curve(segment, distance, v0, top_speed, final_speed, acceleration, jerk, interval);
     } else {
-      m_one_over_acc = 1.0;
+      plan_trapezoid(segment, distance, v0, top_speed, final_speed, acceleration, interval);
+    }
+    for (SpeedRamp &ramp : segment.ramps) {
+      ramp.jerk = ramp.jerk * sign;
+      ramp.acc = ramp.acc * sign;
+      ramp.rise_speed = ramp.rise_speed * sign;
+      ramp.hold_speed = ramp.hold_speed * sign;
+      ramp.end_speed = ramp.end_speed * sign;
+    }
+    segment.distance = Position::from_counts(sign * distance);
+    segment.delta_v = acceleration * interval * interval;
+    m_queued_speed = float(segment.ramps[1].end_speed) / interval;
+    m_acceleration = acceleration;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      m_frequency = loop_time.frequency();
+    }
+    m_queue.push();
+    return true;
+  }
+  /***
+   * Speeds here are in counts per second and the ramps come out in
+   * counts per tick. The direction is applied later.
+   */
+  void plan_trapezoid(MoveSegment &segment, float distance, float v0, float top_speed, float vf,
+                      float acceleration, float interval) {
+    // the continuous profile. For a triangle, the peak is where the
+    // acceleration and braking distances add up to the whole move.
+    float peak = sqrtf(acceleration * distance + 0.5f * (v0 * v0 + vf * vf));
+    float vc = min(top_speed, peak);
+    float t_acc = fabsf(vc - v0) / acceleration;
+    float t_brake = fabsf(vc - vf) / acceleration;
+    float d_acc = 0.5f * (v0 + vc) * t_acc;
+    float d_brake = 0.5f * (vc + vf) * t_brake;
+    float t_cruise = max((distance - d_acc - d_brake) / vc, 0.0f);
+
+    // whole ticks, then the cruise speed that gives the exact distance
+    uint32_t n1 = max(ceilf(t_acc / interval), 1.0f);
+    uint32_t n2 = ceilf(t_cruise / interval);
+    uint32_t n3 = max(ceilf(t_brake / interval), 1.0f);
+    v0 *= interval;
+    vf *= interval;
+    vc = (distance - 0.5f * v0 * (n1 - 1) - 0.5f * vf * (n3 + 1)) / (0.5f * (n1 + n3) + n2);
+
+    segment.ramps[0] = {0, n1, coeff_t(0), coeff_t((vc - v0) / n1), coeff_t(v0), coeff_t(vc), coeff_t(vc)};
+    segment.cruise_ticks = n2;
+    segment.ramps[1] = {0, n3, coeff_t(0), coeff_t((vf - vc) / n3), coeff_t(vc), coeff_t(vf), coeff_t(vf)};
+  }
+
+  // the time for an S-curve change of speed with the acceleration limit a
+  static void s_ramp_times(float dv, float a, float jerk, float &t_jerk, float &t_acc) {
+    dv = fabsf(dv);
+    if (dv * jerk > a * a) {
+      t_jerk = a / jerk;
+      t_acc = dv / a - t_jerk;
+    } else {
+      t_jerk = sqrtf(dv / jerk);
+      t_acc = 0;
     }
-    m_state = CS_ACCELERATING;
+  }
+
+  // an S-curve ramp has a constant average speed so this is easy
+  static float s_ramp_distance(float v1, float v2, float a, float jerk) {
+    float t_jerk, t_acc;
+    s_ramp_times(v2 - v1, a, jerk, t_jerk, t_acc);
+    return 0.5f * (v1 + v2) * (2 * t_jerk + t_acc);
+  }
+
+  void plan_s_curve(MoveSegment &segment, float distance, float v0, float top_speed, float vf,
+                    float acceleration, float jerk, float interval) {
+    // the peak speed for a short move has no closed form so find it by bisection
+    float vc = top_speed;
+    if (s_ramp_distance(v0, vc, acceleration, jerk) + s_ramp_distance(vc, vf, acceleration, jerk) > distance) {
+      float low = max(v0, vf);
+      float high = top_speed;
+      for (int i = 0; i < 24; i++) {
+        vc = 0.5f * (low + high);
+        if (s_ramp_distance(v0, vc, acceleration, jerk) + s_ramp_distance(vc, vf, acceleration, jerk) > distance) {
+          high = vc;
+        } else {
+          low = vc;
+        }
+      }
+      vc = low;
+    }
+    float tj1, ta1, tj3, ta3;
+    s_ramp_times(vc - v0, acceleration, jerk, tj1, ta1);
+    s_ramp_times(vc - vf, acceleration, jerk, tj3, ta3);
+    float d_ramps = s_ramp_distance(v0, vc, acceleration, jerk) + s_ramp_distance(vc, vf, acceleration, jerk);
+    float t_cruise = max((distance - d_ramps) / vc, 0.0f);
+
+    // whole ticks, then the cruise speed that gives the exact distance
+    uint32_t nj1 = max(ceilf(tj1 / interval), 1.0f);
+    uint32_t na1 = ceilf(ta1 / interval);
+    uint32_t nc = ceilf(t_cruise / interval);
+    uint32_t nj3 = max(ceilf(tj3 / interval), 1.0f);
+    uint32_t na3 = ceilf(ta3 / interval);
+    float k1 = (float)nj1 * (nj1 + na1);
+    float k3 = (float)nj3 * (nj3 + na3);
+    float s1 = s_ramp_sum(nj1, na1) / k1;
+    float s3 = s_ramp_sum(nj3, na3) / k3;
+    float n1 = 2 * nj1 + na1;
+    float n3 = 2 * nj3 + na3;
+    v0 *= interval;
+    vf *= interval;
+    vc = (distance - v0 * (n1 - s1) - vf * s3) / (s1 + nc + n3 - s3);
+
+    float j1 = (vc - v0) / k1;
+    float a1 = j1 * nj1;
+    float j3 = (vf - vc) / k3;
+    float a3 = j3 * nj3;
+    float rise1 = v0 + j1 * nj1 * (nj1 + 1) / 2;
+    float rise3 = vc + j3 * nj3 * (nj3 + 1) / 2;
+    segment.ramps[0] = {nj1, na1, coeff_t(j1), coeff_t(a1), coeff_t(rise1), coeff_t(rise1 + a1 * na1), coeff_t(vc)};
+    segment.cruise_ticks = nc;
+    segment.ramps[1] = {nj3, na3, coeff_t(j3), coeff_t(a3), coeff_t(rise3), coeff_t(rise3 + a3 * na3), coeff_t(vf)};
   }
 
   void stop() {
@@ -94,119 +365,213 @@ public:
     finish();
   }
 
+  // abandons anything left in the queue
   void finish() {
     ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      m_queue.clear();
       m_speed = m_target_speed;
+      m_acc = 0;
+      m_tick_acc = 0;
       m_state = CS_FINISHED;
     }
   }
 
   void set_state(ProfileState state) { m_state = state; }
+  uint8_t state() { return m_state; }
 
-  float get_braking_distance() {
-    return fabsf(m_speed * m_speed - m_final_speed * m_final_speed) * 0.5 * m_one_over_acc;
-  }
-
+  // in degrees
   float position() {
-    float pos;
+    Position pos;
     ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
       pos = m_position;
     }
-    return pos;
+    return pos.to_degrees();
   }
 
+  // in degrees per second
   float speed() {
-    float speed;
-    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
-      speed = m_speed;
-    }
-    return speed;
+    return increment() * m_frequency;
   }
 
+  // in degrees
   float increment() {
-    float inc;
+    coeff_t inc;
     ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
-      inc = m_speed * LOOP_INTERVAL;
+      inc = m_speed;
     }
-    return inc;
+    return float(inc) * DEG_PER_COUNT;
   }
 
+  // in degrees per second per second. This is the limit, not the current value
   float acceleration() {
     float acc;
     ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
       acc = m_acceleration;
     }
-    return acc;
+    return acc * DEG_PER_COUNT;
+  }
+
+  // Only for use from within systick where there is no need for a guard.
+  // These are in counts and counts per second.
+  const Position &position_isr() {
+    return m_position;
+  }
+
+  real_t speed_isr() {
+    return real_t(m_speed) * (int)m_frequency;
+  }
+
+  // the change in speed, in counts per second, in the last tick
+  real_t acceleration_isr() {
+    return real_t(m_tick_acc) * (int)m_frequency;
   }
 
   void set_speed(float speed) {
+    coeff_t counts_per_tick = speed * COUNTS_PER_DEG / m_frequency;
     ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
-      m_speed = speed;
+      m_speed = counts_per_tick;
     }
   }
   void set_target_speed(float speed) {
+    coeff_t counts_per_tick = speed * COUNTS_PER_DEG / m_frequency;
     ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
-      m_target_speed = speed;
+      m_target_speed = counts_per_tick;
     }
   }
 
   // normally only used to alter position for forward error correction
   void adjust_position(float adjustment) {
-    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) { m_position += adjustment; }
+    real_t counts = adjustment * COUNTS_PER_DEG;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) { m_position += counts; }
   }
 
   void set_position(float position) {
-    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) { m_position = position; }
+    Position pos = Position::from_degrees(position);
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) { m_position = pos; }
+  }
+
+  /***
+   * A setpoint stream calls these from systick in place of update().
+   * The speed is in counts per tick, as it is here, so there is no
+   * conversion to do in the ISR.
+   */
+  void follow_isr(const Position &position, coeff_t speed) {
+    m_tick_acc = speed - m_speed;
+    m_speed = speed;
+    m_position = position;
+  }
+
+  // the setpoint stays put but there is nothing left to feed forward
+  void hold_isr() {
+    m_speed = 0;
+    m_tick_acc = 0;
   }
 
-  // update is called from within systick and should be safe from interrupts
+  /***
+   * update is called from within systick and should be safe from interrupts
+   *
+   * Once the last move is finished, the speed is ramped to any new target
+   * speed and the setpoint carries on moving at that speed.
+   */
   void update() {
-    if (m_state == CS_IDLE) {
-      return;
-    }
-    float delta_v = m_acceleration * LOOP_INTERVAL;
-    float remaining = fabsf(m_final_position) - fabsf(m_position);
-    if (m_state == CS_ACCELERATING) {
-      if (remaining < get_braking_distance()) {
-        m_state = CS_BRAKING;
-        if (m_final_speed == 0) {
-          m_target_speed = m_sign * 5.0f; // magic number to make sure we reach zero
-        } else {
-          m_target_speed = m_final_speed;
-        };
+    if (m_state == CS_IDLE || m_state == CS_FINISHED) {
+      if (m_queue.is_empty()) {
+        if (m_state == CS_FINISHED) {
+          ramp_to_target();
+          m_position.advance(m_speed);
+        }
+        return;
       }
+      begin_segment();
+    }
+    m_acc += m_jerk;
+    m_speed += m_acc;
+    m_tick_acc = m_acc;
+    m_position.advance(m_speed);
+    if (--m_phase_ticks == 0) {
+      next_phase();
     }
-    // try to reach the target speed
+  }
+
+  void ramp_to_target() {
+    coeff_t old_speed = m_speed;
     if (m_speed < m_target_speed) {
-      m_speed += delta_v;
+      m_speed += m_delta_v;
       if (m_speed > m_target_speed) {
         m_speed = m_target_speed;
       }
     }
     if (m_speed > m_target_speed) {
-      m_speed -= delta_v;
+      m_speed -= m_delta_v;
       if (m_speed < m_target_speed) {
         m_speed = m_target_speed;
       }
     }
-    // increment the position
-    m_position += m_speed * LOOP_INTERVAL;
-    if (m_state != CS_FINISHED && remaining < 0.125) {
-      m_state = CS_FINISHED;
-      m_target_speed = m_final_speed;
+    m_tick_acc = m_speed - old_speed;
+  }
+
+  // the segment stays at the front of the queue until it is finished
+  void begin_segment() {
+    m_segment = &m_queue.front();
+    m_final_position = m_position;
+    m_final_position += m_segment->distance;
+    m_state = CS_ACCELERATING;
+    start_phase(0);
+  }
+
+  void next_phase() {
+    m_speed = m_end_speed;
+    start_phase(m_phase + 1);
+  }
+
+  // skips any empty phases. The cruise phase is empty for a short move.
+  void start_phase(uint8_t phase) {
+    for (; phase < PROFILE_PHASES; phase++) {
+      ProfilePhase next = move_phase(*m_segment, phase);
+      if (next.ticks == 0) {
+        continue;
+      }
+      m_phase = phase;
+      m_phase_ticks = next.ticks;
+      m_acc = next.start_acc;
+      m_jerk = next.jerk;
+      m_end_speed = next.end_speed;
+      if (phase >= BRAKE_PHASE) {
+        m_state = CS_BRAKING;
+      }
+      return;
+    }
+    // the end of this move and possibly straight into the next
+    m_position = m_final_position;
+    m_target_speed = m_speed;
+    m_delta_v = m_segment->delta_v;
+    m_queue.pop();
+    if (!m_queue.is_empty()) {
+      begin_segment();
+      return;
     }
+    m_acc = 0;
+    m_state = CS_FINISHED;
   }
 
 private:
   volatile uint8_t m_state = CS_IDLE;
-  volatile float m_speed = 0;
-  volatile float m_position = 0;
-  int8_t m_sign = 1;
+  coeff_t m_speed = 0; // counts per tick
+  coeff_t m_acc = 0;      // counts per tick per tick
+  coeff_t m_tick_acc = 0; // the acceleration used in the last tick
+  Position m_position;
   float m_acceleration = 0;
-  float m_one_over_acc = 1;
-  float m_target_speed = 0;
-  float m_final_speed = 0;
-  float m_final_position = 0;
+  uint16_t m_frequency = LOOP_FREQUENCY; // loop rate when the profile started
+  coeff_t m_delta_v = 0;                 // for ramp_to_target()
+  RingBuffer<MoveSegment, MOVE_QUEUE_LENGTH> m_queue;
+  const MoveSegment *m_segment = nullptr; // the one running
+  uint8_t m_phase = 0;
+  uint32_t m_phase_ticks = 0;
+  coeff_t m_jerk = 0;      // for the phase running
+  coeff_t m_end_speed = 0; // exact speed at the end of it
+  coeff_t m_target_speed = 0;
+  Position m_final_position;
+  float m_queued_speed = 0; // counts per second at the end of the queue
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,143 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include "../config.h"
+#include "utils.h"
+#include <Arduino.h>
+
+/***
+ * A binary command channel that works alongside the text CLI.
+ *
+ * A host program that drives the target, like the dashboard, spends
+ * most of its time waiting for text commands to be echoed, parsed and
+ * answered. Binary commands are framed, checked and answered without
+ * any text handling.
+ *
+ * Framing
+ * -------
+ * A request is a zero byte, the COBS encoded request and another zero
+ * byte. Text lines never contain a zero so the CLI can tell the two
+ * apart from the first byte. See cli.h. Once decoded, a request is
+ *
+ *     sequence  uint8    chosen by the host, returned in the response
+ *     opcode    uint8
+ *     payload   0 or more bytes, depending on the opcode
+ *     crc       uint8    crc8() of everything before it
+ *
+ * Every request gets one response, COBS encoded and ended with a zero
+ * like the telemetry records. Once decoded it is
+ *
+ *     sequence  uint8    from the request
+ *     status    uint8    ACK or NAK
+ *     opcode    uint8    from the request
+ *     payload   the result, or the reason for a NAK
+ *     crc       uint8    crc8() of everything before it
+ *
+ * All numbers are little endian. Values are IEEE 754 floats.
+ *
+ * Opcodes
+ * -------
+ *   PING           -> version, parameter count
+ *   PARAM_READ     first, count -> first, count, value... Empty reads all
+ *   PARAM_WRITE    (id, value)... -> (id, value)... as stored
+ *   TRIAL_START    trial, text arguments -> ACK, then the trial runs
+ *   TRIAL_ABORT    -> ACK once the drive is stopped
+ *   CAPTURE_INFO   -> state, mask, divisor, samples, capacity, trigger offset, lag
+ *   CAPTURE_READ   first, count -> first, int16 value...
+ *
+ * Parameter ids are the row numbers in the table in parameters.h.
+ * The trials are those in the BINARY_TRIALS table in commands.cpp.
+ * They take the same arguments as the text command, as text, so that
+ * nothing is parsed twice. The ACK goes out before the trial starts
+ * and its report follows. A trial cannot be started while another is
+ * running and the request gets NAK_BUSY.
+ *
+ * Requests are still read while a trial runs so responses can come
+ * between the telemetry records or text rows of its report. Each one
+ * goes out whole. The host should pick out the response by checking
+ * the sequence number, status and opcode as well as the crc.
+ *
+ * Capture values are the raw int16 samples, oldest first with the
+ * channels in mask order. The scaling is given in capture.h.
+ *
+ * python/motorlab-link.py is a host side implementation.
+ */
+
+const uint8_t PROTOCOL_VERSION = 2;
+
+enum Opcode : uint8_t {
+  OP_PING = 0x01,
+  OP_PARAM_READ = 0x10,
+  OP_PARAM_WRITE = 0x11,
+  OP_TRIAL_START = 0x20,
+  OP_TRIAL_ABORT = 0x21,
+  OP_CAPTURE_INFO = 0x30,
+  OP_CAPTURE_READ = 0x31,
+};
+
+enum ResponseStatus : uint8_t {
+  RESPONSE_ACK = 0x06,
+  RESPONSE_NAK = 0x15,
+};
+
+enum NakReason : uint8_t {
+  NAK_FRAME = 1,    // bad COBS, too short or bad crc
+  NAK_OPCODE = 2,   // not a known opcode
+  NAK_LENGTH = 3,   // wrong payload length for the opcode
+  NAK_ARGUMENT = 4, // an id or trial out of range
+  NAK_BUSY = 5,     // a trial is running or the capture is still recording
+};
+
+const uint8_t RESPONSE_HEADER_SIZE = 3;
+const uint8_t RESPONSE_PAYLOAD_SIZE = 56;
+
+/***
+ * Builds a response and sends it as one frame. The payload is limited
+ * to RESPONSE_PAYLOAD_SIZE bytes. Anything that does not fit is left
+ * out and add() returns false.
+ */
+class Response {
+public:
+  Response(uint8_t sequence, uint8_t opcode) {
+    m_data[0] = sequence;
+    m_data[1] = RESPONSE_ACK;
+    m_data[2] = opcode;
+  }
+
+  bool add(const void *data, uint8_t size) {
+    if (m_length + size > RESPONSE_HEADER_SIZE + RESPONSE_PAYLOAD_SIZE) {
+      return false;
+    }
+    memcpy(m_data + m_length, data, size);
+    m_length += size;
+    return true;
+  }
+
+  bool add_byte(uint8_t value) { return add(&value, 1); }
+  bool add_uint16(uint16_t value) { return add(&value, 2); }
+  bool add_int16(int16_t value) { return add(&value, 2); }
+  bool add_float(float value) { return add(&value, 4); }
+
+  uint8_t space() { return RESPONSE_HEADER_SIZE + RESPONSE_PAYLOAD_SIZE - m_length; }
+
+  // replaces any payload with the reason
+  void nak(uint8_t reason) {
+    m_data[1] = RESPONSE_NAK;
+    m_length = RESPONSE_HEADER_SIZE;
+    add_byte(reason);
+  }
+
+  void send() {
+    m_data[m_length] = crc8(m_data, m_length);
+    uint8_t frame[sizeof(m_data) + 2];
+    uint8_t length = cobs_encode(m_data, m_length + 1, frame);
+    frame[length++] = 0;
+    Serial.write(frame, length);
+  }
+
+private:
+  uint8_t m_data[RESPONSE_HEADER_SIZE + RESPONSE_PAYLOAD_SIZE + 1];
+  uint8_t m_length = RESPONSE_HEADER_SIZE;
+};
+
+#endif
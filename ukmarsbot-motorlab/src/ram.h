@@ -0,0 +1,52 @@
+#ifndef RAM_H
+#define RAM_H
+
+#include <Arduino.h>
+
+/***
+ * Measures the use of RAM on the target, for the RAM command.
+ *
+ * The static data, .data and .bss, runs from RAMSTART up to
+ * __heap_start, which the linker provides. Nothing uses the heap so
+ * everything above that is left for the stack, which grows down from
+ * RAMEND. paint_free_ram() fills the gap with a known byte at the very
+ * start of setup(). After that, the lowest byte that no longer holds
+ * it shows how deep the stack has been, its high water mark. Anything
+ * below that has never been used.
+ *
+ * The figures only cover what has been run since the reset. Run a
+ * trial, a binary frame and a capture dump before relying on them.
+ */
+extern uint8_t __heap_start;
+
+const uint8_t RAM_PAINT = 0xC5;
+// room for the stack frame of setup() itself
+const uint8_t RAM_PAINT_MARGIN = 16;
+
+inline void paint_free_ram() {
+  uint8_t *top = (uint8_t *)SP - RAM_PAINT_MARGIN;
+  for (uint8_t *p = &__heap_start; p < top; p++) {
+    *p = RAM_PAINT;
+  }
+}
+
+// the bytes in .data and .bss, as avr-size counts them
+inline uint16_t static_ram() {
+  return &__heap_start - (uint8_t *)RAMSTART;
+}
+
+// the bytes between the static data and the deepest the stack has been
+inline uint16_t unused_ram() {
+  uint8_t *top = (uint8_t *)SP;
+  uint8_t *p = &__heap_start;
+  while (p < top && *p == RAM_PAINT) {
+    p++;
+  }
+  return p - &__heap_start;
+}
+
+inline uint16_t stack_high_water() {
+  return (uint8_t *)RAMEND + 1 - &__heap_start - unused_ram();
+}
+
+#endif
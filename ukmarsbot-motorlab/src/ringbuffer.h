@@ -0,0 +1,65 @@
+#ifndef RINGBUFFER_H
+#define RINGBUFFER_H
+
+#include <Arduino.h>
+#include <stdint.h>
+
+/***
+ * A ring buffer for passing items from the main loop to an interrupt
+ * service routine, or the other way round, without disabling interrupts.
+ *
+ * It is only safe with a single producer and a single consumer. The
+ * producer only ever writes m_head and the consumer only ever writes
+ * m_tail. Each index is a single byte so reading it is atomic on the AVR.
+ *
+ * The indices run freely and wrap at 256. SIZE must be a power of two so
+ * that the slot is just the low bits of the index and the count, head
+ * minus tail, is right even when they wrap.
+ *
+ * The producer fills the slot returned by back() in place and then calls
+ * push() to make it visible. The consumer works on front() in place for
+ * as long as it needs to and then calls pop() to hand the slot back.
+ * Items are never copied.
+ */
+
+// stops the compiler moving memory accesses across this point
+#define COMPILER_BARRIER() asm volatile("" ::: "memory")
+
+template <typename T, uint8_t SIZE>
+class RingBuffer {
+  static_assert(SIZE > 0 && (SIZE & (SIZE - 1)) == 0, "RingBuffer SIZE must be a power of two");
+
+public:
+  bool is_empty() const { return m_head == m_tail; }
+  bool is_full() const { return count() == SIZE; }
+  uint8_t count() const { return (uint8_t)(m_head - m_tail); }
+  uint8_t size() const { return SIZE; }
+
+  // producer only
+  T &back() { return m_items[m_head & (SIZE - 1)]; }
+
+  void push() {
+    COMPILER_BARRIER(); // the item must be complete before it is published
+    m_head = m_head + 1;
+  }
+
+  // consumer only
+  T &front() { return m_items[m_tail & (SIZE - 1)]; }
+
+  void pop() {
+    COMPILER_BARRIER(); // finish with the item before it is handed back
+    m_tail = m_tail + 1;
+  }
+
+  // only when neither side can be running. Use an ATOMIC_BLOCK
+  void clear() {
+    m_tail = m_head;
+  }
+
+private:
+  T m_items[SIZE];
+  volatile uint8_t m_head = 0;
+  volatile uint8_t m_tail = 0;
+};
+
+#endif
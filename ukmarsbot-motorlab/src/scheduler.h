@@ -0,0 +1,134 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include "../config.h"
+#include "utils.h"
+#include <Arduino.h>
+
+/***
+ * The main loop runs a small table of tasks, much as systick does.
+ * Each task is a plain function that does a little work and returns.
+ * Anything that takes longer, like a trial or a capture dump, keeps
+ * its own state and carries on from where it left off the next time
+ * it runs. Nothing ever waits in a task so every task gets to run
+ * again within one pass of the loop.
+ *
+ * A task with a period of 0 runs on every pass. Otherwise the period
+ * is in milliseconds and the task runs once it is due. The next run is
+ * due one period after the last one was due rather than after it ran,
+ * so a late run does not push back the ones after it. A task that
+ * falls more than a whole period behind starts again from now.
+ *
+ * The table is in priority order. When several tasks are due on the
+ * same pass they run in table order so the first gets the least delay.
+ *
+ * A periodic task misses its deadline if it starts a whole period or
+ * more after it was due, because a run has then been lost. The
+ * scheduler counts those misses for each task, along with the longest
+ * time that each task has taken. The longest pass through the whole
+ * table is the most that any task can be held up. The TASKS command
+ * prints them.
+ */
+typedef void (*loop_task_ptr_t)();
+
+const uint8_t LOOP_TASK_NAME_LENGTH = 8;
+
+struct LoopTask {
+  char name[LOOP_TASK_NAME_LENGTH];
+  loop_task_ptr_t run;
+  uint16_t period; // ms between runs, 0 for every pass
+};
+
+const uint8_t MAX_LOOP_TASKS = 6;
+
+class Scheduler;
+extern Scheduler scheduler;
+
+class Scheduler {
+public:
+  // the table must be in PROGMEM with no more than MAX_LOOP_TASKS entries
+  void begin(const LoopTask *tasks, uint8_t count) {
+    m_tasks = tasks;
+    m_count = count;
+    uint16_t now = millis();
+    for (uint8_t i = 0; i < m_count; i++) {
+      m_due[i] = now;
+    }
+    reset();
+  }
+
+  void reset() {
+    for (uint8_t i = 0; i < m_count; i++) {
+      m_max_us[i] = 0;
+      m_missed[i] = 0;
+    }
+    m_max_pass_us = 0;
+  }
+
+  // one pass through the table. Call this from loop()
+  void run() {
+    uint32_t pass_start = micros();
+    uint32_t start = pass_start;
+    for (uint8_t i = 0; i < m_count; i++) {
+      LoopTask task;
+      memcpy_P(&task, &m_tasks[i], sizeof(task));
+      if (task.period) {
+        uint16_t late = uint16_t(millis()) - m_due[i];
+        if (late >= 0x8000) {
+          continue; // not due yet
+        }
+        if (late < task.period) {
+          m_due[i] += task.period;
+        } else {
+          m_due[i] += late + task.period;
+          if (m_missed[i] < 255) {
+            m_missed[i]++;
+          }
+        }
+      }
+      task.run();
+      uint32_t end = micros();
+      record(m_max_us[i], end - start);
+      start = end;
+    }
+    record(m_max_pass_us, micros() - pass_start);
+  }
+
+  /***
+   * Print the figures since the last reset as a table. Times are in
+   * microseconds and anything longer than 65535 shows as 65535.
+   */
+  void print() {
+    Serial.println(F("task       period   max  missed"));
+    for (uint8_t i = 0; i < m_count; i++) {
+      const char *name = m_tasks[i].name;
+      Serial.print((const __FlashStringHelper *)name);
+      for (uint8_t n = strlen_P(name); n < LOOP_TASK_NAME_LENGTH; n++) {
+        Serial.write(' ');
+      }
+      print_justified(int32_t(pgm_read_word(&m_tasks[i].period)), 9);
+      print_justified(int32_t(m_max_us[i]), 6);
+      print_justified(int32_t(m_missed[i]), 8);
+      Serial.println();
+    }
+    Serial.print(F("longest pass "));
+    Serial.print(m_max_pass_us);
+    Serial.println(F("us"));
+  }
+
+private:
+  static void record(uint16_t &max_us, uint32_t elapsed) {
+    if (elapsed > max_us) {
+      max_us = min(elapsed, 0xFFFFUL);
+    }
+  }
+
+  const LoopTask *m_tasks = nullptr;
+  uint8_t m_count = 0;
+  uint16_t m_due[MAX_LOOP_TASKS];
+  uint16_t m_max_us[MAX_LOOP_TASKS];
+  uint8_t m_missed[MAX_LOOP_TASKS];
+  uint16_t m_max_pass_us = 0;
+};
+
+#endif
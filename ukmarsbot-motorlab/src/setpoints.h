@@ -0,0 +1,134 @@
+#ifndef SETPOINTS_H
+#define SETPOINTS_H
+
+#include "../config.h"
+#include "fixed.h"
+#include "looptime.h"
+#include "position.h"
+#include "profile.h"
+#include "ringbuffer.h"
+#include <Arduino.h>
+#include <util/atomic.h>
+
+/***
+ * A stream of setpoints sent by a host that has worked out its own
+ * trajectory. While the stream is active, systick takes one setpoint
+ * from the buffer every tick and hands it to the profile instead of
+ * calling Profile::update().
+ *
+ * Setpoints arrive in degrees and deg/s. They are converted to counts
+ * and counts per tick as they are added so that the ISR only has to
+ * copy them.
+ *
+ * Nothing is taken from the buffer until it is half full. That gives
+ * the host a little slack before the first underrun. If the buffer
+ * does run dry, the setpoint holds its last position with zero speed
+ * and every tick spent waiting is counted as an underrun. The stream
+ * carries on as soon as there is something to take.
+ *
+ * The host should use the fill level that comes back with every
+ * setpoint to decide when to send the next.
+ *
+ * The serial link sets the limit on the stream rate. At 115200 baud a
+ * full 63 character line of about six setpoints takes 5.6ms to arrive,
+ * so no more than about 1000 setpoints a second can be sent. That keeps
+ * up with a loop rate of 250Hz or 500Hz. At 1000Hz there is nothing to
+ * spare and at 2000Hz the buffer runs dry within a few milliseconds.
+ */
+
+struct Setpoint {
+  Position position;
+  coeff_t speed; // counts per tick
+};
+
+// each setpoint takes 12 bytes of RAM. 16 is 32ms at 500Hz
+const uint8_t SETPOINT_BUFFER_LENGTH = 16;
+const uint8_t SETPOINT_START_LEVEL = SETPOINT_BUFFER_LENGTH / 2;
+
+enum StreamState : uint8_t {
+  STREAM_OFF = 0,
+  STREAM_FILLING = 1,
+  STREAM_RUNNING = 2,
+};
+
+class SetpointStream;
+extern SetpointStream setpoints;
+
+class SetpointStream {
+public:
+  void start() {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      m_buffer.clear();
+      m_underruns = 0;
+      m_frequency = loop_time.frequency();
+      m_state = STREAM_FILLING;
+    }
+  }
+
+  void stop() {
+    m_state = STREAM_OFF;
+  }
+
+  bool is_active() { return m_state != STREAM_OFF; }
+  uint8_t state() { return m_state; }
+  uint8_t fill() { return m_buffer.count(); }
+  uint8_t size() { return m_buffer.size(); }
+
+  uint16_t underruns() {
+    uint16_t n;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      n = m_underruns;
+    }
+    return n;
+  }
+
+  /***
+   * Add a setpoint to the end of the buffer. Position is in degrees
+   * from where the stream started and speed is in deg/s.
+   *
+   * Returns false, and does nothing, if the stream is off or the
+   * buffer is full.
+   */
+  bool add(float position, float speed) {
+    if (m_state == STREAM_OFF || m_buffer.is_full()) {
+      return false;
+    }
+    Setpoint &setpoint = m_buffer.back();
+    setpoint.position = Position::from_degrees(position);
+    setpoint.speed = speed * COUNTS_PER_DEG / m_frequency;
+    m_buffer.push();
+    if (m_state == STREAM_FILLING && m_buffer.count() >= SETPOINT_START_LEVEL) {
+      m_state = STREAM_RUNNING;
+    }
+    return true;
+  }
+
+  /***
+   * Called from systick, in place of profile.update(), while the
+   * stream is active.
+   */
+  void update() {
+    if (m_state != STREAM_RUNNING) {
+      profile.hold_isr();
+      return;
+    }
+    if (m_buffer.is_empty()) {
+      profile.hold_isr();
+      if (m_underruns < 0xFFFF) {
+        m_underruns++;
+      }
+      return;
+    }
+    const Setpoint &setpoint = m_buffer.front();
+    profile.follow_isr(setpoint.position, setpoint.speed);
+    m_buffer.pop();
+  }
+
+private:
+  RingBuffer<Setpoint, SETPOINT_BUFFER_LENGTH> m_buffer;
+  volatile uint8_t m_state = STREAM_OFF;
+  uint16_t m_underruns = 0;
+  uint16_t m_frequency = LOOP_FREQUENCY;
+};
+
+#endif
@@ -9,7 +9,15 @@
 /***
  * Settings is where we hold the working copies of many of the
  * parameters described in the config files
+ *
+ * In EEPROM the data is stored with a layout version and its size in
+ * front and a CRC after it. Anything written by firmware with another
+ * layout, or never written at all, fails the check and is not loaded.
+ * Change SETTINGS_VERSION whenever a field in Data is added, removed,
+ * moved or changes its meaning.
  */
+const uint8_t SETTINGS_VERSION = 2;
+
 struct Settings {
   struct Data {
     uint8_t control_flags;
@@ -23,6 +31,15 @@ struct Settings {
     float biasFF;
     float speedFF;
     float accFF;
+    uint16_t loopHz;
+    uint8_t speedMode;
+  };
+
+  struct Stored {
+    uint8_t version;
+    uint8_t size;
+    Data data;
+    uint8_t crc;
   };
 
   Data data;
@@ -33,39 +50,36 @@ struct Settings {
 
   /***
    * Read the working settings from EEPROM.
-   * Undoes changes
+   * Undoes changes. Returns false, and leaves the settings alone, if
+   * the EEPROM does not hold settings with this layout.
    */
-  void read() {
-    Data d;
-    EEPROM.get(0, d);
-    data = d;
+  bool read() {
+    Stored stored;
+    EEPROM.get(0, stored);
+    if (stored.version != SETTINGS_VERSION || stored.size != sizeof(Data)) {
+      return false;
+    }
+    if (stored.crc != crc8(&stored.data, sizeof(Data))) {
+      return false;
+    }
+    data = stored.data;
+    return true;
   };
 
   /***
    * Store the current working settings to EEPROM
    */
   void write() {
-    EEPROM.put(0, data);
+    Stored stored;
+    stored.version = SETTINGS_VERSION;
+    stored.size = sizeof(Data);
+    stored.data = data;
+    stored.crc = crc8(&data, sizeof(Data));
+    EEPROM.put(0, stored);
   };
 
-  /***
-   * Print the current working settings
-   */
-  /* clang-format off */
-  void print() {
-    Serial.print(F("    degPerCount = "));    Serial.println(data.degPerCount, 5);
-    Serial.print(F("             Km = "));    Serial.println(data.Km, 2);
-    Serial.print(F("             Tm = "));    Serial.println(data.Tm, 5);
-    Serial.print(F("         biasFF = "));    Serial.println(data.biasFF, 5);
-    Serial.print(F("        speedFF = "));    Serial.println(data.speedFF, 5);
-    Serial.print(F("          accFF = "));    Serial.println(data.accFF, 5);
-    Serial.print(F("           zeta = "));    Serial.println(data.zeta, 5);
-    Serial.print(F("             Td = "));    Serial.println(data.Td, 5);
-    Serial.print(F("             KP = "));    Serial.println(data.Kp, 5);
-    Serial.print(F("             KD = "));    Serial.println(data.Kd, 5);
-  };
+  // The '$' command prints the settings. See parameters.h
 };
-/* clang-format on */
 
 extern Settings settings;
 
@@ -85,6 +99,8 @@ const Settings::Data defaults = {
   biasFF : BIAS_FF,
   speedFF : SPEED_FF,
   accFF : ACC_FF,
+  loopHz : (uint16_t)LOOP_FREQUENCY,
+  speedMode : 0,
 };
 
 #endif
@@ -0,0 +1,128 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include "../config.h"
+#include "encoders.h"
+#include "fixed.h"
+#include "looptime.h"
+#include "motors.h"
+#include "position.h"
+#include "profile.h"
+#include "ringbuffer.h"
+#include <Arduino.h>
+#include <util/atomic.h>
+
+/***
+ * A copy of the control state as it was at the end of one tick.
+ *
+ * Systick publishes a new copy every tick once the controllers have
+ * run. Anything that wants to report on the control loop should use
+ * the snapshot rather than the live variables so that all the values
+ * come from the same tick. Within systick, the capture reads it
+ * directly with state_isr(). Outside the ISR, the reports take samples
+ * as described below and there is no need to turn interrupts off.
+ *
+ * Positions and speeds are in counts and counts per second, as the
+ * control code uses them. The conversion to degrees is left to the
+ * reader.
+ *
+ * Samples for reporting
+ * ---------------------
+ * The reports want one row every N ticks, not whatever tick happens
+ * to be current when the main loop gets round to it. So, once every
+ * N ticks, publish() also copies the state into a separate sample and
+ * sets a flag to say that it is ready. The reader takes the sample and
+ * clears the flag. The ISR leaves the sample alone while the flag is
+ * set so there is nothing to guard. If the reader is still busy with
+ * the last sample when the next one is due, the new one is dropped and
+ * counted. The tick count in each sample shows where the gap is.
+ */
+
+struct ControlState {
+  uint32_t tick;
+  Position set_position;
+  Position robot_position;
+  real_t set_speed;
+  real_t robot_speed;
+  real_t ctrl_volts;
+  real_t ff_volts;
+  real_t motor_volts;
+};
+
+class ControlSnapshot;
+extern ControlSnapshot snapshot;
+
+class ControlSnapshot {
+public:
+  // Only from within systick
+  void publish() {
+    m_state.tick = loop_time.ticks_isr();
+    m_state.set_position = profile.position_isr();
+    m_state.robot_position = encoders.robot_position_isr();
+    m_state.set_speed = profile.speed_isr();
+    m_state.robot_speed = encoders.speed_isr();
+    m_state.ctrl_volts = motors.m_ctrl_volts;
+    m_state.ff_volts = motors.m_ff_volts;
+    m_state.motor_volts = motors.m_motor_volts;
+    if (--m_sample_countdown == 0) {
+      m_sample_countdown = m_sample_divisor;
+      if (m_sample_ready) {
+        m_missed_samples++;
+      } else {
+        m_sample = m_state;
+        COMPILER_BARRIER(); // the sample must be complete before it is handed over
+        m_sample_ready = true;
+      }
+    }
+  }
+
+  /***
+   * Latch a sample every divisor ticks, starting with the next one.
+   * Any sample not yet taken is thrown away.
+   */
+  void start_sampling(uint8_t divisor) {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      m_sample_divisor = max(divisor, 1);
+      m_sample_countdown = 1;
+      m_sample_ready = false;
+      m_missed_samples = 0;
+    }
+  }
+
+  bool sample_ready() { return m_sample_ready; }
+
+  // Returns false if there is no new sample. Never from an interrupt.
+  bool take_sample(ControlState &state) {
+    if (!m_sample_ready) {
+      return false;
+    }
+    state = m_sample;
+    COMPILER_BARRIER();
+    m_sample_ready = false;
+    return true;
+  }
+
+  // samples dropped since start_sampling() because the last was not taken
+  uint16_t missed_samples() {
+    uint16_t missed;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      missed = m_missed_samples;
+    }
+    return missed;
+  }
+
+  // Only from within systick, after publish()
+  const ControlState &state_isr() {
+    return m_state;
+  }
+
+private:
+  ControlState m_state;
+  ControlState m_sample;
+  volatile bool m_sample_ready = false;
+  uint8_t m_sample_divisor = 1;
+  uint8_t m_sample_countdown = 1;
+  uint16_t m_missed_samples = 0;
+};
+
+#endif
@@ -34,7 +34,66 @@
 
 #include "../config.h"
 #include "adc.h"
+#include "capture.h"
+#include "looptime.h"
 #include "motors.h"
+#include "setpoints.h"
+#include "snapshot.h"
+#include "timing.h"
+
+class Systick;
+extern Systick systick;
+
+/***
+ * Systick runs a small table of tasks, all of them on every tick, in
+ * table order. The table is in PROGMEM to save RAM. Each task is also
+ * a stage for isr_timing so the table must be in the same order as
+ * the stages in timing.h
+ *
+ * Anything that does not need to run every tick belongs in the main
+ * loop. The battery compensation, for example, needs a divide so it is
+ * worked out there. The controllers only use the last value it left in
+ * motors.
+ */
+typedef void (*systick_task_ptr_t)();
+
+#if CURRENT_SENSE
+// the current loop can change the motor volts at any time
+inline void task_encoders() {
+  real_t volts;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    volts = motors.m_motor_volts;
+  }
+  encoders.update(volts);
+}
+#else
+inline void task_encoders() { encoders.update(motors.m_motor_volts); }
+#endif
+// a host-streamed trajectory takes the place of the profile
+inline void task_profile() {
+  if (setpoints.is_active()) {
+    setpoints.update();
+  } else {
+    profile.update();
+  }
+}
+inline void task_controllers() { motors.update_controllers(); }
+inline void task_publish() { snapshot.publish(); }
+inline void task_capture() { capture.update(); }
+inline void task_adc() { adc.start_adc_cycle(); }
+
+const systick_task_ptr_t systick_tasks[] PROGMEM = {
+  task_encoders,    // T_ENCODERS
+  task_profile,     // T_PROFILE
+  task_controllers, // T_CONTROLLERS
+  task_publish,     // T_PUBLISH
+  task_capture,     // T_CAPTURE
+  task_adc,         // T_ADC
+};
+
+const uint8_t SYSTICK_TASK_COUNT = sizeof(systick_tasks) / sizeof(systick_tasks[0]);
+static_assert(SYSTICK_TASK_COUNT == T_SYSTICK, "There must be one systick task for each stage in timing.h");
+
 class Systick {
 public:
   // don't let this start firing up before we are ready.
@@ -43,19 +102,47 @@ public:
     bitClear(TCCR2A, WGM20);
     bitSet(TCCR2A, WGM21);
     bitClear(TCCR2B, WGM22);
-    // set divisor to 128 => 125kHz
-    bitSet(TCCR2B, CS22);
-    bitClear(TCCR2B, CS21);
-    bitSet(TCCR2B, CS20);
-    OCR2A = 249; // (16000000/128/500)-1 => 500Hz
+    // the prescaler sets the loop rate. See looptime.h
+    set_clock_select(loop_time.clock_select());
+    OCR2A = TIMER2_COUNTS_PER_TICK - 1; // 250 counts per tick at any rate
     bitSet(TIMSK2, OCIE2A);
     delay(10); // make sure it runs for a few cycles before we continue
   }
+
+  /***
+   * Change the loop rate on the fly. Only 250, 500, 1000 and 2000Hz are
+   * available. Returns false and leaves the rate alone for anything else.
+   *
+   * The controller coefficients are recalculated to suit. A profile that
+   * is already running keeps the rate it started with so only do this
+   * when the drive is idle.
+   */
+  bool set_frequency(uint16_t frequency) {
+    if (!loop_time.set_frequency(frequency)) {
+      return false;
+    }
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      set_clock_select(loop_time.clock_select());
+      TCNT2 = 0;
+    }
+    motors.load_coefficients();
+    encoders.load_coefficients();
+#if CURRENT_SENSE
+    current_loop.load_coefficients();
+#endif
+    return true;
+  }
+
+  void set_clock_select(uint8_t clock_select) {
+    TCCR2B = (TCCR2B & ~(_BV(CS22) | _BV(CS21) | _BV(CS20))) | clock_select;
+  }
+
   /***
    * This is the SYSTICK ISR. It runs at 500Hz by default and is
    * called from the TIMER 2 interrupt (vector 7).
    *
-   * All the time-critical control functions happen in here.
+   * All the time-critical control functions happen in here. They are
+   * listed in the systick_tasks table above.
    *
    * interrupts are enabled at the start of the ISR so that encoder
    * counts are not lost.
@@ -75,14 +162,18 @@ public:
    * Most of the load is due to that overhead. While the profile generates actual
    * motion, there is an additional load.
    *
+   * Those figures were measured by hand. Each stage is now timed by isr_timing
+   * and the LOAD command will report the current figures.
    *
    */
   void update() {
-    encoders.update();
-    profile.update();
-    motors.set_battery_compensation(adc.get_battery_comp());
-    motors.update_controllers();
-    adc.start_adc_cycle();
-    // NOTE: no code should follow this line;
+    isr_timing.start_tick();
+    for (uint8_t i = 0; i < SYSTICK_TASK_COUNT; i++) {
+      systick_task_ptr_t run = (systick_task_ptr_t)pgm_read_ptr(&systick_tasks[i]);
+      run();
+      isr_timing.mark(i);
+    }
+    isr_timing.end_tick();
+    // NOTE: no other code should follow this line;
   }
 };
@@ -0,0 +1,114 @@
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include "../config.h"
+#include "fixed.h"
+#include "position.h"
+#include "snapshot.h"
+#include "utils.h"
+#include <Arduino.h>
+
+/***
+ * Binary telemetry for the controller reports.
+ *
+ * A text report row is about 60 characters. At 115200 baud that is over
+ * 5ms so only one tick in three or more gets reported at 500Hz. A binary
+ * record is 22 bytes on the wire, a little under a third of that, so
+ * every tick can be sent at 500Hz.
+ *
+ * Each record is a fixed layout of little endian integers, scaled so
+ * that no floating point is needed to fill it:
+ *
+ *    offset  type     value
+ *       0    uint8    sequence number, counts up by one for every record
+ *       1    uint16   tick count, low 16 bits
+ *       3    int32    setpoint position, 1/256 count
+ *       7    int16    position error (setpoint - robot), 1/64 count
+ *       9    int16    setpoint speed, 1/4 count per second
+ *      11    int16    robot speed, 1/4 count per second
+ *      13    int16    controller output, millivolts
+ *      15    int16    feedforward output, millivolts
+ *      17    int16    motor volts, millivolts
+ *      19    uint8    crc8 of bytes 0 to 18
+ *
+ * Values that do not fit are clipped. The speeds go up to 8191 counts
+ * per second, about twice what the motorlab motor reaches at 6V. The
+ * 20 bytes are then COBS
+ * encoded and terminated with a zero. The decoder, in
+ * python/telemetry-decoder.py, uses the sequence number to spot lost
+ * records and the tick count to spot ticks that were not sent.
+ *
+ * Text written to the serial port, like the comment lines from the
+ * trials, never contains a zero so it can be mixed with the records.
+ *
+ * A record is only sent if there is room for all of it in the serial
+ * transmit buffer. Otherwise it is dropped so that the caller never
+ * waits. The sequence number still counts it so the gap in the next
+ * record that does go out tells the decoder how many were dropped.
+ */
+
+struct __attribute__((packed)) TelemetryRecord {
+  uint8_t sequence;
+  uint16_t tick;
+  int32_t set_position;
+  int16_t position_error;
+  int16_t set_speed;
+  int16_t robot_speed;
+  int16_t ctrl_mv;
+  int16_t ff_mv;
+  int16_t motor_mv;
+};
+
+const uint8_t TELEMETRY_RAW_SIZE = sizeof(TelemetryRecord) + 1;   // with the crc
+const uint8_t TELEMETRY_FRAME_SIZE = TELEMETRY_RAW_SIZE + 2;      // COBS and the terminator
+
+// steps per count per second, for telemetry and capture. Must match
+// python/telemetry-decoder.py
+const int SPEED_SCALE = 4;
+
+// scale a value to an int16 without overflow
+inline int16_t scaled_int16(real_t value, int scale) {
+  const real_t limit = 32767.0f / scale;
+  value = constrain(value, -limit, limit);
+  return floor_int(value * scale + real_t(0.5f));
+}
+
+class Telemetry {
+public:
+  void reset() {
+    m_sequence = 0;
+  }
+
+  // returns false if the record was dropped
+  bool send(const ControlState &state) {
+    if (Serial.availableForWrite() < TELEMETRY_FRAME_SIZE) {
+      m_sequence++;
+      return false;
+    }
+    TelemetryRecord record;
+    record.sequence = m_sequence++;
+    record.tick = state.tick;
+    const Position &set = state.set_position;
+    record.set_position = set.counts() * 256 + floor_int(real_t(set.fraction()) * 256);
+    record.position_error = scaled_int16(state.set_position - state.robot_position, 64);
+    record.set_speed = scaled_int16(state.set_speed, SPEED_SCALE);
+    record.robot_speed = scaled_int16(state.robot_speed, SPEED_SCALE);
+    record.ctrl_mv = scaled_int16(state.ctrl_volts, 1000);
+    record.ff_mv = scaled_int16(state.ff_volts, 1000);
+    record.motor_mv = scaled_int16(state.motor_volts, 1000);
+
+    uint8_t raw[TELEMETRY_RAW_SIZE];
+    memcpy(raw, &record, sizeof(record));
+    raw[sizeof(record)] = crc8(raw, sizeof(record));
+    uint8_t frame[TELEMETRY_FRAME_SIZE];
+    uint8_t length = cobs_encode(raw, sizeof(raw), frame);
+    frame[length++] = 0;
+    Serial.write(frame, length);
+    return true;
+  }
+
+private:
+  uint8_t m_sequence = 0;
+};
+
+#endif
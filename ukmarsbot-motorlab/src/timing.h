@@ -0,0 +1,217 @@
+#ifndef TIMING_H
+#define TIMING_H
+
+#include "../config.h"
+#include "looptime.h"
+#include "utils.h"
+#include <Arduino.h>
+#include <util/atomic.h>
+
+/***
+ * Instrumentation for the interrupt service routines.
+ *
+ * Timer 2 generates the systick interrupt in CTC mode so its counter
+ * restarts from zero at the start of every tick. That makes TCNT2 a free
+ * timestamp: on entry to the systick ISR it holds the interrupt latency
+ * and, after that, the time elapsed since the tick began. Reading it is a
+ * single instruction so the instrumentation can stay in place all the time.
+ *
+ * The resolution is one timer count, 8us at the default 500Hz loop rate. That is
+ * coarse compared with the encoder ISR which takes only a few microseconds.
+ * However, encoder edges arrive at random with respect to the timer so the
+ * mean, taken over many edges, is still a good estimate of the real cost.
+ * The encoder ISR is only timed if ENCODER_ISR_TIMING is set in config.h
+ *
+ * Each stage keeps min, max and mean times. There is also a histogram of the
+ * variation in the time between systick interrupts. Each bin is one timer
+ * count wide and the centre bin holds ticks that arrived on time.
+ *
+ * TCNT2 wraps once per tick so it cannot time a tick that runs past the
+ * next compare match. The hardware sets OCF2A on that match, and it stays
+ * set because the compare interrupt is masked while systick runs. If it is
+ * set at the end of the tick, the tick is counted as an overrun and
+ * recorded as OVERRUN_COUNTS, which is more than a whole tick.
+ */
+
+enum TimingStage : uint8_t {
+  T_ENCODERS = 0,
+  T_PROFILE,
+  T_CONTROLLERS,
+  T_PUBLISH,
+  T_CAPTURE,
+  T_ADC,
+  T_SYSTICK,
+  T_ENCODER_ISR,
+  T_STAGE_COUNT,
+};
+
+const int JITTER_BINS = 9;
+
+// recorded for a tick that overran. Any tick is at most 250 counts
+const uint8_t OVERRUN_COUNTS = 255;
+
+// stage names, padded to a fixed width of 9 characters
+const char STAGE_NAMES[] PROGMEM = "encoders profile  control  publish  capture  adc      systick  enc_isr  ";
+
+struct StageTiming {
+  uint8_t min;
+  uint8_t max;
+  uint32_t count;
+  uint32_t total;
+};
+
+class IsrTiming;
+extern IsrTiming isr_timing;
+
+class IsrTiming {
+public:
+  IsrTiming() {
+    reset();
+  }
+
+  void reset() {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      for (int i = 0; i < T_STAGE_COUNT; i++) {
+        m_stages[i].min = 255;
+        m_stages[i].max = 0;
+        m_stages[i].count = 0;
+        m_stages[i].total = 0;
+      }
+      for (int i = 0; i < JITTER_BINS; i++) {
+        m_jitter[i] = 0;
+      }
+      m_have_last_entry = false;
+      m_overruns = 0;
+    }
+  }
+
+  // The counter is cleared on compare match so it wraps at OCR2A, not 255
+  static uint8_t counts_between(uint8_t start, uint8_t now) {
+    uint8_t elapsed = now - start;
+    if (now < start) {
+      elapsed -= 255 - OCR2A;
+    }
+    return elapsed;
+  }
+
+  static uint8_t elapsed_since(uint8_t start) {
+    return counts_between(start, TCNT2);
+  }
+
+  void record(uint8_t stage, uint8_t counts) {
+    StageTiming &s = m_stages[stage];
+    if (counts < s.min) {
+      s.min = counts;
+    }
+    if (counts > s.max) {
+      s.max = counts;
+    }
+    s.count++;
+    s.total += counts;
+  }
+
+  // call first thing in the systick ISR
+  void start_tick() {
+    uint8_t entry = TCNT2;
+    if (m_have_last_entry) {
+      int bin = JITTER_BINS / 2 + (int)entry - (int)m_last_entry;
+      bin = constrain(bin, 0, JITTER_BINS - 1);
+      if (m_jitter[bin] < 0xFFFF) {
+        m_jitter[bin]++;
+      }
+    }
+    m_last_entry = entry;
+    m_have_last_entry = true;
+    m_stamp = entry;
+  }
+
+  // call at the end of each stage of the systick ISR
+  void mark(uint8_t stage) {
+    uint8_t now = TCNT2;
+    record(stage, counts_between(m_stamp, now));
+    m_stamp = now;
+  }
+
+  // call last thing in the systick ISR. Includes the entry latency.
+  void end_tick() {
+    if (TIFR2 & _BV(OCF2A)) {
+      m_overruns++;
+      record(T_SYSTICK, OVERRUN_COUNTS);
+      return;
+    }
+    record(T_SYSTICK, m_stamp);
+  }
+
+  uint16_t overruns() {
+    uint16_t n;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      n = m_overruns;
+    }
+    return n;
+  }
+
+  /***
+   * Print the results as a table with all times in microseconds.
+   * The load is the percentage of the available processor time
+   * taken up by that stage.
+   */
+  void print() {
+    float us_per_count = loop_time.us_per_count();
+    uint32_t ticks;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      ticks = m_stages[T_SYSTICK].count;
+    }
+    Serial.println(F("stage      min  max   mean  load%"));
+    for (int i = 0; i < T_STAGE_COUNT; i++) {
+      StageTiming s;
+      ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        s = m_stages[i];
+      }
+      for (int n = 0; n < 9; n++) {
+        Serial.write(pgm_read_byte(STAGE_NAMES + 9 * i + n));
+      }
+      if (s.count == 0) {
+        Serial.println(F("    -    -      -      -"));
+        continue;
+      }
+      float mean = s.total * us_per_count / s.count;
+      float load = 0;
+      if (ticks > 0) {
+        load = 100.0f * s.total / (ticks * (float)TIMER2_COUNTS_PER_TICK);
+      }
+      print_justified(int(s.min * us_per_count), 5);
+      print_justified(int(s.max * us_per_count), 5);
+      Serial.print(' ');
+      Serial.print(mean, 1);
+      Serial.print(' ');
+      Serial.print(load, 1);
+      Serial.println();
+    }
+    Serial.print(F("jitter(us)"));
+    for (int i = 0; i < JITTER_BINS; i++) {
+      print_justified(int((i - JITTER_BINS / 2) * us_per_count), 6);
+    }
+    Serial.println();
+    Serial.print(F("ticks     "));
+    for (int i = 0; i < JITTER_BINS; i++) {
+      uint16_t n;
+      ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        n = m_jitter[i];
+      }
+      print_justified(int32_t(n), 6);
+    }
+    Serial.println();
+    Serial.print(F("overruns "));
+    Serial.println(overruns());
+  }
+
+private:
+  StageTiming m_stages[T_STAGE_COUNT];
+  uint16_t m_jitter[JITTER_BINS];
+  uint8_t m_stamp = 0;
+  uint8_t m_last_entry = 0;
+  bool m_have_last_entry = false;
+  uint16_t m_overruns = 0;
+};
+
+#endif
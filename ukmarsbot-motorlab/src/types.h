@@ -34,6 +34,8 @@
 
 #pragma once
 
+#include <stdint.h>
+
 const int MAX_ARGC = 16;
 struct Args {
   int argc;
@@ -47,10 +49,12 @@ typedef enum {
   CLI_E_CMD_NOT_FOUND, /* Command name not found in command table. */
   CLI_E_INVALID_ARGS,  /* Invalid function parameters/arguments.   */
   CLI_E_BUF_FULL,      /* CLI buffer full.                         */
-  CLI_IDLE             /* No command to execute at the moment      */
+  CLI_IDLE,            /* No command to execute at the moment      */
+  CLI_RUNNING          /* Command still running. No prompt yet     */
 } cli_status_t;
 
 typedef cli_status_t (*cmd_func_ptr_t)(const Args &args);
+typedef cli_status_t (*frame_func_ptr_t)(uint8_t *frame, uint8_t length);
 
 typedef void (*println_func_ptr_t)(char *string);
 
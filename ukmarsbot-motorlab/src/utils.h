@@ -3,8 +3,36 @@
 
 #include "types.h"
 #include <Arduino.h>
+
+// the hardware serial transmit buffer can hold one less than this
+#ifndef SERIAL_TX_BUFFER_SIZE
+#define SERIAL_TX_BUFFER_SIZE 64
+#endif
+
 #define MAX_DIGITS 8
 
+/***
+ * The names in the command and parameter tables are looked up by a
+ * hash, worked out by the compiler for the tables and at run time for
+ * the name typed. The CLI makes everything upper case so the hash
+ * ignores case. It is FNV-1a, cut down to 16 bits.
+ */
+constexpr char name_upper(char c) {
+  return (c >= 'a' && c <= 'z') ? c - 'a' + 'A' : c;
+}
+
+constexpr uint16_t name_hash(const char *name, uint16_t hash = 0x811C) {
+  return *name ? name_hash(name + 1, uint16_t((hash ^ uint8_t(name_upper(*name))) * 0x0193)) : hash;
+}
+
+inline uint16_t hash_name(const char *name) {
+  uint16_t hash = 0x811C;
+  while (*name) {
+    hash = (hash ^ uint8_t(name_upper(*name++))) * 0x0193;
+  }
+  return hash;
+}
+
 // simple formatting functions for printing maze costs
 inline void print_hex_2(unsigned char value) {
   if (value < 16) {
@@ -13,27 +41,44 @@ inline void print_hex_2(unsigned char value) {
   Serial.print(value, HEX);
 }
 
-inline void print_justified(int32_t value, int width) {
-  int v = value;
-  int w = width;
-  w--;
-  if (v < 0) {
-    w--;
+// enough spaces to right justify a number with this many digits
+inline void print_padding(Print &out, uint32_t magnitude, int width) {
+  width--;
+  while (magnitude /= 10) {
+    width--;
   }
-  while (v /= 10) {
-    w--;
+  while (width > 0) {
+    out.write(' ');
+    --width;
   }
-  while (w > 0) {
-    Serial.write(' ');
-    --w;
+}
+
+inline void print_justified(Print &out, int32_t value, int width) {
+  if (value < 0) {
+    print_padding(out, -value, width - 1);
+  } else {
+    print_padding(out, value, width);
   }
-  Serial.print(value);
+  out.print(value);
+}
+
+inline void print_justified(Print &out, uint32_t value, int width) {
+  print_padding(out, value, width);
+  out.print(value);
+}
+
+inline void print_justified(int32_t value, int width) {
+  print_justified(Serial, value, width);
 }
 
 inline void print_justified(int value, int width) {
   print_justified(int32_t(value), width);
 }
 
+inline void print_justified(Print &out, int value, int width) {
+  print_justified(out, int32_t(value), width);
+}
+
 /***
  * Scan a character array for an integer.
  * Begin scan at line[pos]
@@ -76,13 +121,13 @@ inline uint8_t read_integer(const char *line, int &value) {
  * Assumes no leading spaces.
  * Only scans MAX_DIGITS characters
  * Stops at first non-digit, or decimal point.
- * MODIFIES pos so that it points to the first character after the number
+ * MODIFIES end, if given, so that it points to the first character after the number
  * MODIFIES value ONLY IF a valid float is converted
- * RETURNS  boolean status indicating success or error
+ * RETURNS  the number of digits converted so zero means an error
  *
  * optimisations are possible but may not be worth the effort
  */
-inline uint8_t read_float(const char *line, float &value) {
+inline uint8_t read_float(const char *line, float &value, const char **end = nullptr) {
 
   char *ptr = (char *)line;
   char c = *ptr++;
@@ -112,6 +157,9 @@ inline uint8_t read_float(const char *line, float &value) {
       c = *ptr++;
     }
   }
+  if (end) {
+    *end = ptr - 1;
+  }
   float b = a;
   while (exponent < 0) {
     b *= 0.1;
@@ -123,6 +171,17 @@ inline uint8_t read_float(const char *line, float &value) {
   return digits;
 }
 
+// only if the whole token is a number. A trailing letter is a typo.
+inline bool read_whole_float(const char *token, float &value) {
+  const char *end;
+  float result;
+  if (read_float(token, result, &end) == 0 || *end != '\0') {
+    return false;
+  }
+  value = result;
+  return true;
+}
+
 /* Copyright (c) 2011 The Chromium OS Authors. All rights reserved.
  * Use of this source code is governed by a BSD-style license that can be
  * found in the chromiumos LICENSE file.
@@ -144,4 +203,56 @@ inline uint8_t crc8(const void *vptr, int len) {
   return (uint8_t)(crc >> 8);
 }
 
+/***
+ * Consistent Overhead Byte Stuffing. The encoded data has no zero bytes
+ * so a zero can be used to mark the end of each frame. The output is
+ * one byte longer than the input for up to 254 bytes of input.
+ *
+ * Returns the length of the encoded data. The terminating zero is not
+ * added.
+ */
+inline uint8_t cobs_encode(const uint8_t *src, uint8_t len, uint8_t *dst) {
+  uint8_t code_index = 0;
+  uint8_t code = 1;
+  uint8_t out = 1;
+  for (uint8_t i = 0; i < len; i++) {
+    if (src[i] == 0) {
+      dst[code_index] = code;
+      code_index = out++;
+      code = 1;
+    } else {
+      dst[out++] = src[i];
+      code++;
+    }
+  }
+  dst[code_index] = code;
+  return out;
+}
+
+/***
+ * Undo cobs_encode(). The input is the frame without its terminating
+ * zero. The output is never longer than the input so it can be
+ * decoded in place, with dst the same as src.
+ *
+ * Returns the length of the decoded data or 0 if the frame is not
+ * valid COBS.
+ */
+inline uint8_t cobs_decode(const uint8_t *src, uint8_t len, uint8_t *dst) {
+  uint8_t in = 0;
+  uint8_t out = 0;
+  while (in < len) {
+    uint8_t code = src[in++];
+    if (code == 0 || code - 1 > len - in) {
+      return 0;
+    }
+    for (uint8_t i = 1; i < code; i++) {
+      dst[out++] = src[in++];
+    }
+    if (code < 0xFF && in < len) {
+      dst[out++] = 0;
+    }
+  }
+  return out;
+}
+
 #endif
\ No newline at end of file